@@ -6,17 +6,214 @@
 #include <vector>
 #include <cstring>
 #include <memory>
+#include <deque>
+#include <functional>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <future>
+
+#include <sched.h>
+#include <pthread.h>
 
 using namespace std;
 
 #define SERVO_MAX_SPACE 0x80
+#define ERROR_HISTORY 32
+#define HISTORY_CHANNELS 8
+
+struct i2c_message;
 
 namespace openservo {
 
 class ServoBus;
+class Servo;
+class WriteSession;
+class ServoGroup;
+class TelemetryWriter;
+
+// Outcome of the last update of a single servo
+enum UpdateStatus : unsigned char {
+  UPDATE_OK = 0,
+  UPDATE_NAK,
+  UPDATE_TIMEOUT,
+  UPDATE_SHORT_READ,
+  UPDATE_BUS_ERROR,
+  UPDATE_QUARANTINED,
+  UPDATE_ABORTED,
+  UPDATE_CORRUPTED
+};
+
+enum TransactionClass {
+  TRANSACTION_COMMAND = 0,
+  TRANSACTION_WRITE,
+  TRANSACTION_READ
+};
+
+// Retry and timing policy of a bus, all times are in microseconds and zero
+// disables the corresponding limit.
+struct BusPolicy {
+  BusPolicy();
+
+  int retries[3];     // additional attempts per TransactionClass
+  int deadline;       // maximum duration of a transaction including retries
+  int backoff;        // delay before the first retry, doubled on every retry
+  int backoff_limit;  // upper bound for the retry delay
+  int budget;         // maximum duration of a ServoBus::update cycle
+};
+
+// Scope of the advisory lock that serializes bus access between processes
+enum BusLocking {
+  LOCKING_NONE = 0,     // no arbitration
+  LOCKING_TRANSACTION,  // lock around every logical transaction
+  LOCKING_CYCLE         // lock around whole update, flush and refresh cycles
+};
+
+struct LockStatistics {
+  unsigned long acquired;   // locks taken
+  unsigned long contended;  // locks that had to wait for another process
+  unsigned long failed;     // locks the adapter refused, the bus was used unlocked
+  unsigned long timeouts;   // waits cut off by the policy, the bus was used unlocked
+  uint64_t waited;          // total time spent waiting in microseconds
+  uint64_t longest;         // longest single wait in microseconds
+};
+
+// Duration of a transaction of each TransactionClass as overhead plus
+// per_byte times the number of payload bytes, in microseconds
+struct CostModel {
+  CostModel();
+
+  bool calibrated;
+  double overhead[3];
+  double per_byte[3];
+};
+
+// Priority classes of scheduled transactions, most urgent first
+enum Priority : unsigned char {
+  PRIORITY_SAFETY = 0,  // never deferred, executed even past the cycle budget
+  PRIORITY_SETPOINT,    // executed even past their deadline
+  PRIORITY_FAST,        // fast telemetry
+  PRIORITY_SLOW,        // slow telemetry
+  PRIORITY_CONFIG       // configuration, dropped first
+};
+
+#define PRIORITY_CLASSES 5
+
+enum ScheduledOperation : unsigned char {
+  SCHEDULE_DISABLE = 0, // disable PWM output
+  SCHEDULE_ENABLE,
+  SCHEDULE_RESET,
+  SCHEDULE_SEEK,        // write seek position and velocity from the cache
+  SCHEDULE_FLUSH,       // write all pending registers
+  SCHEDULE_STATUS,      // read status registers
+  SCHEDULE_FULL         // read all registers
+};
+
+#define SCHEDULE_OPERATIONS 7
+
+// Counters per priority class
+struct SchedulerStatistics {
+  unsigned long executed[PRIORITY_CLASSES];
+  unsigned long deferred[PRIORITY_CLASSES];  // postponed to a later cycle for lack of budget
+  unsigned long dropped[PRIORITY_CLASSES];   // discarded after their deadline passed
+  unsigned long held[PRIORITY_CLASSES];      // kept queued while their servo was quarantined
+  unsigned long missed[PRIORITY_CLASSES];    // completed late or dropped
+};
+
+enum ErrorCode : unsigned char {
+  ERROR_NONE = 0,
+  ERROR_OPEN,
+  ERROR_WRITE_ENABLE,
+  ERROR_WRITE_DISABLE,
+  ERROR_SEND,
+  ERROR_RECEIVE,
+  ERROR_COMMAND,
+  ERROR_DEADLINE,
+  ERROR_OVERLOAD,
+  ERROR_QUARANTINED,
+  ERROR_LOCK
+};
+
+struct ErrorRecord {
+  ErrorCode code;
+  UpdateStatus status;   // classified transport result
+  unsigned char address; // servo address
+  unsigned char from;    // first register of the affected range
+  unsigned char to;      // last register of the affected range
+  int error;             // errno reported by the adapter, 0 if none
+  uint64_t timestamp;
+};
+
+// Cubic Hermite motion segment as understood by the servo curve buffer
+struct CurveSegment {
+  int delta;         // duration of the segment in milliseconds
+  int position;      // position at the end of the segment
+  int in_velocity;   // velocity at the start of the segment
+  int out_velocity;  // velocity at the end of the segment
+};
+
+// Telemetry sample recorded on a refresh
+struct Sample {
+  uint64_t timestamp;               // host monotonic time in microseconds
+  int timer;                        // servo TIMER register
+  int values[HISTORY_CHANNELS];     // recorded registers in configured order
+};
+
+// Monotonic host time in microseconds
+uint64_t timestamp();
+
+// Scheduling of the bus poll thread, see sched_setscheduler(2)
+struct RealtimeConfig {
+  RealtimeConfig();
+
+  int policy;         // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+  int priority;       // static priority of the real-time policies
+  int cpu;            // CPU the poll thread is pinned to, -1 for any
+  bool lock_memory;   // lock current and future pages into memory
+};
+
+// Recursive mutex with priority inheritance: an application thread holding
+// the bus runs at the priority of a real-time poll thread waiting for it,
+// so threads of intermediate priority can not stall the poller behind it
+class BusMutex {
+public:
+
+  BusMutex();
+  ~BusMutex();
+
+  BusMutex(const BusMutex&) = delete;
+  BusMutex& operator=(const BusMutex&) = delete;
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+private:
+
+  pthread_mutex_t handle;
+
+};
+
+// Count heap allocations made by the calling thread from now on (or stop
+// counting), getAllocations returns the total over all counted threads. The
+// count is only maintained when the library is built with
+// OPENSERVO_TRACK_ALLOCATIONS, otherwise getAllocations returns -1.
+void trackAllocations(bool enabled);
+long getAllocations();
+
+// Called with the old value, the new value and the timestamp of the sample
+typedef std::function<void(Servo& servo, int previous, int current, uint64_t timestamp)> WatchCallback;
+
+// Called with each recorded sample in turn, the reference is only valid
+// during the call
+typedef std::function<void(const Sample& sample)> SampleVisitor;
 
 class Servo {
 friend ServoBus;
+friend WriteSession;
+friend ServoGroup;
 public:
 
   virtual ~Servo();
@@ -36,6 +233,8 @@ public:
   bool isReadonly(const string& name) const;
   bool isProtected(const string& name) const;
   bool exists(const string& name) const;
+  // Name of the register at the given address, empty if there is none
+  string getName(int address) const;
 
   int getType();
   int getSubType();
@@ -65,6 +264,59 @@ public:
 
   bool update(bool full = false);
 
+  // Write pending registers only
+  bool flush();
+  // Read status registers only (all registers if full is set)
+  bool refresh(bool full = false);
+  // Immediately write seek position (and velocity if not negative)
+  bool seekNow(int position, int velocity = -1);
+
+  // Asynchronous variants executed by the bus executor thread
+  std::future<bool> updateAsync(bool full = false);
+  std::future<bool> seekAsync(int position, int velocity = -1);
+
+  // Curve streaming, queued segments are moved to the servo curve buffer by
+  // flush whenever the servo reports free slots.
+  bool curveStart();
+  bool curveStop();
+  void curveAppend(const CurveSegment& segment);
+  int curvePending() const;
+  int getCurveBuffer();
+
+  // Servo is not moving and within the PID deadband of its seek position
+  bool isSettled();
+  // Block until the servo settles or timeout (in microseconds) elapses, the
+  // status is refreshed by the bus poller if it is running
+  bool waitUntilSettled(int timeout);
+
+  // Callbacks invoked after a refresh when a register value changes, crosses
+  // a threshold or when any of the masked flag bits flip. Callbacks run on
+  // the updating thread with the bus locked. Return an id for unwatch or -1
+  // if the register does not exist.
+  int watch(const string& name, WatchCallback callback);
+  int watchThreshold(const string& name, int threshold, WatchCallback callback);
+  int watchFlags(int mask, WatchCallback callback);
+  void unwatch(int id);
+
+  // Record the given registers (at most HISTORY_CHANNELS) on every refresh
+  // into a preallocated ring of capacity samples, capacity 0 disables it.
+  // Replaced rings are kept until the servo is destroyed.
+  bool record(int capacity, const vector<string>& registers);
+  // Visit recorded samples newer than since, oldest first, from any thread
+  // without blocking the updating thread or allocating. Returns the number
+  // of samples visited.
+  int history(const SampleVisitor& visitor, uint64_t since = 0) const;
+  // Copy recorded samples newer than since into samples
+  int history(vector<Sample>& samples, uint64_t since = 0) const;
+
+  // Health tracking
+
+  bool isResponsive() const;
+  int getFailures() const;
+  UpdateStatus getStatus() const;
+  uint64_t getLastSample() const;
+  unsigned long getCorruptions() const;
+
   void print(ostream& out) const;
 
 protected:
@@ -81,23 +333,142 @@ private:
   void write2B(const int address, int value);
   void write1B(const int address, int value);
 
+  // locked register access by address for the typed accessors, which
+  // avoids the name lookup and its string temporaries
+  int fetch(int address, int length) const;
+  void store(int address, int length, int value);
+
+  void confirm(int from, int to);
+
+  bool stream();
+
+  int subscribe(const string& name, int kind, int argument, WatchCallback callback);
+  void notify();
+
+  struct History;
+  void sample();
+
   bool command(unsigned char cmd);
 
+  bool probe();
+  bool health(bool success);
+
+  bool beginSession(int timeout);
+  bool endSession();
+  bool expire();
+
   ServoBus* bus;
 
-  bool responsive;  // TODO: not used at the moment
+  bool responsive;
+  int failures;
+  UpdateStatus status;
+  uint64_t sampled;
   bool updated;
   bool locked;
+  bool session;
+  uint64_t session_expires;
+
+  bool curve;
+  deque<CurveSegment> curve_queue;
 
   unsigned char data[SERVO_MAX_SPACE];
   bool local[SERVO_MAX_SPACE];
 
+  // last values known to be on the servo and registers written this cycle
+  unsigned char confirmed[SERVO_MAX_SPACE];
+  bool written[SERVO_MAX_SPACE];
+
+  struct Watch {
+    int id;
+    int kind;
+    int address;
+    int length;
+    int argument;
+    bool removed;
+    WatchCallback callback;
+  };
+
+  vector<Watch> watches;
+  // watches added while notifying, appended once it is done
+  vector<Watch> added;
+  int watch_counter;
+  bool notifying;
+  // register image at the time of the previous notification
+  uint64_t previous[SERVO_MAX_SPACE / 8];
+
+  // published ring, replaced rings stay in rings until the servo is
+  // destroyed since history() may still be reading them
+  std::atomic<History*> recorder;
+  vector<std::unique_ptr<History>> rings;
+
 };
 
 typedef std::shared_ptr<Servo> ServoHandler;
 
+/*
+  Keeps write access to protected registers of a servo open for its lifetime.
+  WRITE_ENABLE is sent once on construction and WRITE_DISABLE when the session
+  is closed, destroyed or when timeout (in microseconds, 0 for none) elapses
+  during an update.
+*/
+class WriteSession {
+public:
+
+  WriteSession(ServoHandler servo, int timeout = 0);
+  ~WriteSession();
+
+  WriteSession(const WriteSession&) = delete;
+  WriteSession& operator=(const WriteSession&) = delete;
+
+  bool isActive() const;
+  bool close();
+
+private:
+
+  ServoHandler servo;
+
+};
+
+/*
+  Servos on the same bus that move together. Pending writes of all servos in
+  the group are sent back to back before any status is read, so that new seek
+  positions reach all servos within the shortest possible window.
+*/
+class ServoGroup {
+public:
+
+  ServoGroup();
+  ServoGroup(const vector<ServoHandler>& servos);
+  ~ServoGroup();
+
+  bool add(ServoHandler servo);
+  void clear();
+  int size() const;
+  ServoHandler get(int i) const;
+
+  // Write pending registers of all servos in the group, then read them
+  bool update(bool full = false);
+  // Write pending registers of all servos in the group only
+  bool commit();
+
+  // Duration of the last commit in microseconds
+  uint64_t getWriteWindow() const;
+
+  // Block until all servos in the group settle or timeout (in microseconds)
+  // elapses
+  bool waitUntilSettled(int timeout);
+
+private:
+
+  ServoBus* bus;
+  vector<ServoHandler> servos;
+  uint64_t window;
+
+};
+
 class ServoBus {
 friend Servo;
+friend ServoGroup;
 public:
 
   ServoBus();
@@ -105,35 +476,229 @@ public:
 
   bool open(const string& port);
   bool close();
+  // Updates every responsive servo even if some fail, returns true only if
+  // all of them succeeded. Servo::getStatus tells which ones did not.
   bool update(bool full = false);
 
+  // Attempts every servo regardless of failures and stores the outcome for
+  // each servo (in bus order) into status, returns the number of servos
+  // updated successfully.
+  int update(vector<UpdateStatus>& status, bool full = false);
+
+  // Write pending registers of all servos, batched into a single transfer
+  // where the adapter supports it, and read status registers of all servos.
+  bool flush();
+  bool refresh(bool full = false);
+
+  // Submit a cycle to the bus executor thread, which is started on first
+  // use, and return immediately. Submitted work runs in submission order.
+  std::future<bool> updateAsync(bool full = false);
+  std::future<bool> flushAsync();
+  std::future<bool> refreshAsync(bool full = false);
+
+  // Nonblocking eventfd that becomes readable whenever an asynchronous or
+  // polled cycle completes, reading it returns the number of cycles since
+  // the last read. Owned by the bus.
+  int getEventFd();
+
+  // Commands for all servos on the bus, sent as a single general call when
+  // enabled and as one combined transfer to every servo otherwise.
+  bool enableAll();
+  bool disableAll();
+  bool resetAll();
+
+  // Servo firmware on this bus honors commands sent to the general call address
+  void setGeneralCall(bool enabled);
+
   int scan(bool force = false);
 
+  // Update all servos from a background thread every period microseconds
+  bool start(int period, bool full = false);
+  // Real-time mode: buffers for the current set of servos are preallocated,
+  // memory is locked if requested and the poll thread runs with the given
+  // scheduling. Allocations of the poll thread after its first cycle are
+  // counted by getAllocations. Returns false if a setting was refused.
+  bool setRealtime(const RealtimeConfig& config);
+  void stop();
+  bool isPolling() const;
+  // Block until the poller completes a cycle or timeout (in microseconds)
+  // elapses, returns false on timeout or if the poller is not running
+  bool wait(int timeout);
+
   ServoHandler get(int i);
   ServoHandler find(int address);
   bool exists(int address); 
   int size();
 
-
+  // Servos that fail threshold consecutive updates are quarantined and only
+  // probed every interval-th bus update until they respond again.
+  void setQuarantine(int threshold, int interval);
+  vector<ServoHandler> quarantined();
+
+  void setPolicy(const BusPolicy& policy);
+  BusPolicy getPolicy() const;
+
+  // Measure the transaction cost model on a responsive servo with samples
+  // repetitions per transaction size. Only transactions without side effects
+  // are used: reads, writes to unused write protected registers and the write
+  // disable command. Fails if the servo has write access enabled.
+  bool calibrate(int samples = 16);
+  CostModel getCostModel() const;
+  void setCostModel(const CostModel& model);
+  // Predicted duration of an update of all servos in microseconds, 0 if the
+  // bus is not calibrated
+  uint64_t predict(bool full = false);
+
+  // Use CHECKED_TXN transactions for register reads and writes, blocks that
+  // fail checksum validation are repeated up to retries times.
+  void setChecked(bool enabled, int retries = 2);
+  bool isChecked() const;
+
+  // Do not read back registers written in the same cycle
+  void setReadbackElision(bool enabled);
+  // Checksum failures for a single address or the whole bus (address < 0)
+  unsigned long getCorruptions(int address = -1) const;
+
+  // Cooperating processes (including other ServoBus instances on the same
+  // device) take an advisory lock on the adapter, by default around every
+  // transaction so that no other process can split a select from its read.
+  void setLocking(BusLocking mode);
+  BusLocking getLocking() const;
+  LockStatistics getLockStatistics();
+
+  // Queue a transaction with an absolute deadline (see timestamp(), 0 for
+  // none). A transaction already queued for the same servo is merged, keeping
+  // the more urgent priority and the earlier deadline. Without an explicit
+  // priority commands are safety, seek is setpoint, status reads are fast and
+  // full reads slow telemetry, and flush is configuration.
+  bool schedule(ServoHandler servo, ScheduledOperation operation, uint64_t deadline = 0);
+  bool schedule(ServoHandler servo, ScheduledOperation operation, Priority priority, uint64_t deadline);
+  // Queue the work of a regular update of every servo: dirty setpoints,
+  // other pending writes and the status (or full) read
+  void scheduleCycle(bool full = false, uint64_t deadline = 0);
+  // Execute queued transactions in priority and deadline order until the
+  // cycle budget of the policy is spent, returns the number executed
+  int execute();
+  int getScheduled();
+  SchedulerStatistics getSchedulerStatistics();
+
+  // Message for the most recent error not yet returned by this method
   string getLastError();
 
+  // Copies retained error records with sequence number at least since,
+  // returns the sequence number of the next record.
+  uint32_t getErrors(vector<ErrorRecord>& records, uint32_t since = 0) const;
+  string describe(const ErrorRecord& record) const;
+
+  // Publish register images of every refresh into the named POSIX shared
+  // memory region, keeping capacity records per servo (see TelemetryReader)
+  bool exportTelemetry(const string& name, int capacity);
+  void stopTelemetry();
 
 protected:
 
   bool send(unsigned char address, unsigned char data_address, unsigned char* data, int data_lenght); 
   bool receive(unsigned char address, unsigned char data_address, unsigned char* data, int data_lenght);
 
-  void setLastError(const string& message, ...);
+  void error(ErrorCode code, int address = 0, int from = 0, int to = 0);
+
+  bool retry(TransactionClass type, uint64_t started, int attempt);
+  bool batch(i2c_message* messages, int count);
+  bool broadcast(unsigned char cmd);
+  bool flushTargets(const vector<ServoHandler>& targets);
+  bool flushBatch(const vector<ServoHandler>& targets, bool& success);
+
+  bool transfer(TransactionClass type, unsigned char address, unsigned char* request, int request_len, unsigned char* response, int response_len);
+
+  bool sendChecked(unsigned char address, unsigned char data_address, unsigned char* data, int data_length);
+  bool receiveChecked(unsigned char address, unsigned char data_address, unsigned char* data, int data_length);
+
+  void poll();
+
+  double cost(TransactionClass type, int bytes) const;
+  uint64_t predict(Servo* servo, bool full) const;
+  int mergeGap() const;
+
+  struct Arbitration;
+  void acquire(BusLocking scope);
+  void release(BusLocking scope);
+
+  // guards servo state and the bus handle, held for a whole update cycle
+  BusMutex mutex;
 
 private:
 
   void* handle;
   vector<ServoHandler> servos;
+
+  string port;
+  int result;
+
+  BusPolicy policy;
+  CostModel model;
+  uint64_t cycle_start;
+
+  bool checked;
+  int checked_retries;
+  unsigned long corrupted[128];
+
+  bool batching;
+  bool elision;
+  bool general_call;
+  vector<i2c_message> batch_messages;
+  vector<unsigned char> batch_buffer;
+  vector<Servo*> batch_servos;
  
-  string errormessage;
+  struct ErrorSlot {
+    std::atomic<uint32_t> sequence;
+    ErrorRecord record;
+  };
+
+  ErrorSlot errors[ERROR_HISTORY];
+  std::atomic<uint32_t> errors_head;
+  uint32_t errors_read;
+
+  int quarantine_threshold;
+  int quarantine_interval;
+  unsigned long cycle;
+
+  std::unique_ptr<TelemetryWriter> telemetry;
+
+  struct Scheduler;
+  std::unique_ptr<Scheduler> scheduler;
+
+  BusLocking locking;
+  int lock_depth;
+  LockStatistics lock_stats;
+
+  std::thread poller;
+  std::atomic<bool> polling;
+  int poll_period;
+  bool poll_full;
+  vector<UpdateStatus> poll_status;
+  std::mutex poll_mutex;
+  std::condition_variable poll_signal;
+  unsigned long poll_cycles;
+
+  std::future<bool> submit(std::function<bool()> work);
+  void run();
+  void completed();
+  void halt();
+
+  std::thread executor;
+  bool executing;
+  std::deque<std::function<void()> > tasks;
+  std::mutex task_mutex;
+  std::condition_variable task_signal;
+  std::atomic<int> completion;
 
   int cleanupServos();
   int addServos();
+  bool recover(Servo* servo);
+  void reserve();
+
+  bool realtime;
+  RealtimeConfig realtime_config;
 
 };
 
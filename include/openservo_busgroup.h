@@ -0,0 +1,95 @@
+#ifndef __OPENSERVO_BUSGROUP
+#define __OPENSERVO_BUSGROUP
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+#include "openservo.h"
+
+namespace openservo {
+
+// Servo position in the address space of a ServoBusGroup
+struct ServoLocation {
+  int bus;        // index of the bus in the group
+  int address;    // i2c address on that bus
+};
+
+/*
+  Several buses driven in parallel, each by its own worker thread that owns
+  the bus for the lifetime of the group. Group operations are dispatched to
+  all workers at once and return when the slowest bus completes, so a cycle
+  over many buses takes as long as the longest one rather than the sum.
+*/
+class ServoBusGroup {
+public:
+
+  ServoBusGroup();
+  ~ServoBusGroup();
+
+  // Open a bus (see ServoBus::open for port syntax) and start its worker,
+  // pinned to the given CPU if it is not negative. Returns the bus index or
+  // -1 if the bus can not be opened.
+  int open(const string& port, int cpu = -1);
+  void close();
+
+  int buses() const;
+  // Direct access to a bus, only safe while no group operation is running
+  ServoBus& bus(int index);
+
+  // Scan all buses in parallel, returns the total number of servos
+  int scan(bool force = false);
+  int size();
+  vector<ServoLocation> list();
+  ServoHandler find(int bus, int address);
+  ServoHandler find(const ServoLocation& location);
+
+  // Barrier operations over all buses, true if every bus succeeded
+  bool updateAll(bool full = false);
+  bool flushAll();
+  bool refreshAll(bool full = false);
+
+  // Outcome of the last update, flush or refresh of a bus and wall time in
+  // microseconds of the last group operation
+  bool getResult(int bus) const;
+  uint64_t getCycleTime() const;
+
+private:
+
+  enum Operation {
+    OPERATION_NONE = 0,
+    OPERATION_SCAN,
+    OPERATION_SCAN_FORCE,
+    OPERATION_UPDATE,
+    OPERATION_UPDATE_FULL,
+    OPERATION_FLUSH,
+    OPERATION_REFRESH,
+    OPERATION_REFRESH_FULL,
+    OPERATION_STOP
+  };
+
+  struct Worker;
+
+  int dispatch(Operation operation);
+  void work(Worker* worker);
+
+  vector<std::unique_ptr<Worker> > workers;
+
+  // guards dispatching and the job state of all workers
+  std::mutex mutex;
+  std::condition_variable started;
+  std::condition_variable finished;
+  unsigned long generation;
+  int running;
+
+  // serializes group operations of different threads
+  std::mutex serial;
+
+  uint64_t cycle_time;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef __OPENSERVO_CORO
+#define __OPENSERVO_CORO
+
+#include <coroutine>
+#include <deque>
+#include <vector>
+
+#include "openservo.h"
+
+namespace openservo {
+
+class BusExecutor;
+
+// Fire and forget coroutine started with BusExecutor::spawn
+class Task {
+public:
+
+  struct promise_type {
+    Task get_return_object() noexcept;
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  Task(Task&& other) noexcept;
+  ~Task();
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+private:
+
+  friend class BusExecutor;
+
+  explicit Task(std::coroutine_handle<promise_type> handle): handle(handle) {}
+
+  std::coroutine_handle<promise_type> handle;
+
+};
+
+// Bus operation awaited by a task, resumes with the operation result
+class Operation {
+public:
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle);
+  bool await_resume() const noexcept { return result; }
+
+private:
+
+  friend class BusExecutor;
+
+  enum Kind {
+    KIND_UPDATE,
+    KIND_REFRESH,
+    KIND_SEEK,
+    KIND_SETTLE
+  };
+
+  Operation(BusExecutor* executor, Kind kind): executor(executor), kind(kind),
+    full(false), position(0), velocity(-1), deadline(0), result(false) {}
+
+  BusExecutor* executor;
+  Kind kind;
+  ServoHandler servo;
+  bool full;
+  int position;
+  int velocity;
+  uint64_t deadline;
+  bool result;
+  std::coroutine_handle<> waiter;
+
+};
+
+/*
+  Runs any number of tasks on the thread that calls run, multiplexing their
+  bus operations onto a single bus. Tasks that await an update or refresh in
+  the same round share one bus cycle, seeks are written in the order they
+  were awaited and settle waits are served by status refreshes every
+  settle interval until the servo settles or the wait times out.
+*/
+class BusExecutor {
+public:
+
+  BusExecutor(ServoBus& bus, int interval = 2000);
+  ~BusExecutor();
+
+  void spawn(Task task);
+
+  // Resume tasks and execute their bus operations until all tasks finish
+  void run();
+
+  Operation update(bool full = false);
+  Operation refresh(bool full = false);
+  Operation seek(ServoHandler servo, int position, int velocity = -1);
+  // Resumes with false if the servo does not settle within timeout microseconds
+  Operation waitUntilSettled(ServoHandler servo, int timeout);
+
+private:
+
+  friend class Operation;
+
+  void resume(Operation* operation, bool result);
+  void cycle();
+  void settle();
+
+  ServoBus& bus;
+  int interval;
+  uint64_t refreshed;
+
+  std::deque<std::coroutine_handle<> > ready;
+  vector<std::coroutine_handle<Task::promise_type> > tasks;
+
+  vector<Operation*> cycles;
+  vector<Operation*> seeks;
+  vector<Operation*> settling;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef __OPENSERVO_PROTOCOL
+#define __OPENSERVO_PROTOCOL
+
+#include <stdint.h>
+
+/*
+  Binary protocol of the openservod Unix domain socket. A client sends
+  request frames, each a ProtocolHeader followed by count ProtocolEntry
+  structures, and receives one response frame with the same sequence and
+  the same entries, with status and value filled in. All fields are in host
+  byte order since both ends run on the same machine.
+
+  GET entries are answered from the register image of the last bus cycle.
+  SET and COMMAND entries of all clients are collected and applied in the
+  next bus cycle, the response is sent once the cycle completes.
+*/
+
+#define OPENSERVOD_SOCKET "/run/openservod.sock"
+
+#define PROTOCOL_MAGIC 0x4F53
+#define PROTOCOL_MAX_ENTRIES 256
+
+// frame types
+#define PROTOCOL_REQUEST 1
+#define PROTOCOL_RESPONSE 2
+
+// entry operations
+#define PROTOCOL_GET 1
+#define PROTOCOL_SET 2
+#define PROTOCOL_COMMAND 3
+
+// entry status
+#define PROTOCOL_OK 0
+#define PROTOCOL_NOT_FOUND 1      // no such bus, servo or register
+#define PROTOCOL_READONLY 2       // register can not be written
+#define PROTOCOL_FAILED 3         // bus transaction failed
+#define PROTOCOL_INVALID 4        // unknown operation or command
+
+// commands, address 0 sends the command to all servos on the bus
+#define PROTOCOL_COMMAND_RESET 0x80
+#define PROTOCOL_COMMAND_ENABLE 0x82
+#define PROTOCOL_COMMAND_DISABLE 0x83
+#define PROTOCOL_COMMAND_SAVE 0x86
+#define PROTOCOL_COMMAND_RESTORE 0x87
+#define PROTOCOL_COMMAND_DEFAULT 0x88
+
+#pragma pack(push, 1)
+
+typedef struct ProtocolHeader {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t sequence;
+  uint16_t count;
+} ProtocolHeader;
+
+typedef struct ProtocolEntry {
+  uint8_t operation;
+  uint8_t bus;          // index of the bus in daemon configuration order
+  uint8_t address;      // servo i2c address
+  uint8_t reg;          // register address or command code
+  uint8_t status;
+  uint8_t reserved;
+  uint16_t value;
+} ProtocolEntry;
+
+#pragma pack(pop)
+
+#endif
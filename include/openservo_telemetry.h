@@ -0,0 +1,103 @@
+#ifndef __OPENSERVO_TELEMETRY
+#define __OPENSERVO_TELEMETRY
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+#include "openservo.h"
+
+#define TELEMETRY_MAGIC 0x4F535452
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_SERVOS 128
+
+namespace openservo {
+
+/*
+  Shared memory layout: a TelemetryHeader followed by TELEMETRY_SERVOS rings
+  (one per i2c address) of capacity TelemetryRecord entries each. A record
+  is guarded by its sequence number, which is odd while the record is being
+  written and 2 * (index + 1) once record index of its ring is complete.
+*/
+
+struct TelemetrySample {
+  uint64_t timestamp;                     // host monotonic time in microseconds
+  uint8_t address;
+  uint8_t status;                         // UpdateStatus of the refresh
+  uint8_t reserved[6];
+  uint8_t registers[SERVO_MAX_SPACE];     // device register image, the last
+                                          // confirmed one if the refresh failed
+};
+
+struct TelemetryRecord {
+  std::atomic<uint64_t> sequence;
+  TelemetrySample sample;
+};
+
+struct TelemetryHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;                      // records per servo ring
+  uint32_t record_size;
+  std::atomic<uint64_t> heads[TELEMETRY_SERVOS];  // records written per servo
+};
+
+// Publishes servo register images into a POSIX shared memory region
+class TelemetryWriter {
+public:
+
+  TelemetryWriter();
+  ~TelemetryWriter();
+
+  bool open(const string& name, int capacity);
+  void close();
+  bool isOpen() const;
+
+  void publish(int address, UpdateStatus status, uint64_t timestamp, const unsigned char* registers);
+
+private:
+
+  string name;
+  size_t size;
+  TelemetryHeader* header;
+  TelemetryRecord* records;
+
+};
+
+// Maps a telemetry region read-only, without access to the bus
+class TelemetryReader {
+public:
+
+  TelemetryReader();
+  ~TelemetryReader();
+
+  bool open(const string& name);
+  void close();
+  bool isOpen() const;
+
+  int capacity() const;
+
+  // Number of records ever published for a servo, the retained ones have
+  // indices from count - capacity to count - 1
+  uint64_t count(int address) const;
+
+  // Record in place, without copying. It may be overwritten while it is being
+  // read, so check isValid with the same index afterwards.
+  const TelemetrySample* at(int address, uint64_t index) const;
+  const TelemetrySample* latest(int address, uint64_t* index = NULL) const;
+  bool isValid(int address, uint64_t index) const;
+
+  // Consistent copy of a record, false if it is not retained any more
+  bool copy(int address, uint64_t index, TelemetrySample& sample) const;
+
+private:
+
+  size_t size;
+  const TelemetryHeader* header;
+  const TelemetryRecord* records;
+
+};
+
+}
+
+#endif
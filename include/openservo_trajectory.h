@@ -0,0 +1,72 @@
+#ifndef __OPENSERVO_TRAJECTORY
+#define __OPENSERVO_TRAJECTORY
+
+#include <vector>
+
+#include "openservo.h"
+
+namespace openservo {
+
+enum ProfileType {
+  PROFILE_CUBIC,        // smooth cubic spline through the waypoints
+  PROFILE_TRAPEZOIDAL   // constant acceleration, cruise and deceleration between waypoints
+};
+
+/*
+  Time parameterized motion of many joints through common waypoints. Data is
+  stored as structure of arrays with joints innermost, so evaluation of all
+  joints at a single time instant is a straight loop over contiguous memory.
+  Times are in seconds, positions in servo position units and velocities in
+  position units per second.
+*/
+class Trajectory {
+public:
+
+  Trajectory(int joints, ProfileType type = PROFILE_CUBIC);
+  ~Trajectory();
+
+  int joints() const;
+  int waypoints() const;
+  double duration() const;
+
+  // Positions are clamped to the limits, by default the full 16 bit range,
+  // including waypoints that were added before the limits were set
+  void setLimits(int joint, int min, int max);
+  void setLimits(int joint, ServoHandler servo);
+
+  // Fraction of each segment spent accelerating (and decelerating) in the
+  // trapezoidal profile, between 0 and 0.5
+  void setBlend(float blend);
+
+  // Waypoints have to be added in increasing time order
+  bool addWaypoint(double time, const int* positions);
+  bool addWaypoint(double time, const vector<int>& positions);
+  void clear();
+
+  // Setpoints of all joints at the given time
+  void sample(double time, int* positions, int* velocities = NULL) const;
+
+  // Curve segments of a single joint for streaming with Servo::curveAppend
+  vector<CurveSegment> segments(int joint) const;
+
+private:
+
+  int segment(double time) const;
+  void solve();
+
+  int count;
+  ProfileType type;
+  float blend;
+
+  vector<float> minimum;
+  vector<float> maximum;
+
+  vector<double> times;
+  vector<float> points;     // waypoint positions, [waypoint * count + joint]
+  vector<float> tangents;   // waypoint velocities, [waypoint * count + joint]
+
+};
+
+}
+
+#endif
@@ -0,0 +1,70 @@
+#include "openservo.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace openservo {
+
+static thread_local bool tracked = false;
+static std::atomic<unsigned long> allocations(0);
+
+void trackAllocations(bool enabled) {
+
+  tracked = enabled;
+
+}
+
+long getAllocations() {
+
+#ifdef OPENSERVO_TRACK_ALLOCATIONS
+  return allocations.load(std::memory_order_relaxed);
+#else
+  return -1;
+#endif
+
+}
+
+#ifdef OPENSERVO_TRACK_ALLOCATIONS
+
+static void* allocate(std::size_t size) {
+
+  if (tracked)
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+  void* pointer = malloc(size ? size : 1);
+
+  if (!pointer)
+    throw std::bad_alloc();
+
+  return pointer;
+
+}
+
+#endif
+
+}
+
+#ifdef OPENSERVO_TRACK_ALLOCATIONS
+
+// Replaces the global allocation functions of the whole process, the array
+// and nothrow forms of the standard library forward to these.
+
+void* operator new(std::size_t size) {
+
+  return openservo::allocate(size);
+
+}
+
+void operator delete(void* pointer) noexcept {
+
+  free(pointer);
+
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+
+  free(pointer);
+
+}
+
+#endif
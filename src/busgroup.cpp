@@ -0,0 +1,267 @@
+#include "openservo_busgroup.h"
+
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+
+namespace openservo {
+
+struct ServoBusGroup::Worker {
+
+  Worker(): cpu(-1), generation(0), operation(OPERATION_NONE), result(0) {}
+
+  ServoBus bus;
+  std::thread thread;
+  int cpu;
+
+  // job state, guarded by the group mutex
+  unsigned long generation;
+  Operation operation;
+  int result;
+
+};
+
+ServoBusGroup::ServoBusGroup(): generation(0), running(0), cycle_time(0) {
+
+}
+
+ServoBusGroup::~ServoBusGroup() {
+
+  close();
+
+}
+
+int ServoBusGroup::open(const string& port, int cpu) {
+
+  std::lock_guard<std::mutex> guard(serial);
+
+  std::unique_ptr<Worker> worker(new Worker());
+
+  if (!worker->bus.open(port))
+    return -1;
+
+  worker->cpu = cpu;
+
+  {
+    // a new worker waits for the next dispatched operation
+    std::lock_guard<std::mutex> lock(mutex);
+    worker->generation = generation;
+  }
+
+  Worker* w = worker.get();
+  workers.push_back(std::move(worker));
+  w->thread = std::thread(&ServoBusGroup::work, this, w);
+
+  return workers.size() - 1;
+
+}
+
+void ServoBusGroup::close() {
+
+  std::lock_guard<std::mutex> guard(serial);
+
+  if (workers.empty()) return;
+
+  dispatch(OPERATION_STOP);
+
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i]->thread.join();
+
+  workers.clear();
+
+}
+
+int ServoBusGroup::buses() const {
+
+  return workers.size();
+
+}
+
+ServoBus& ServoBusGroup::bus(int index) {
+
+  return workers[index]->bus;
+
+}
+
+/*
+  Start an operation on all workers and wait until the last one completes.
+  Returns the sum of the worker results. The caller holds the serial lock.
+*/
+int ServoBusGroup::dispatch(Operation op) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  uint64_t start = timestamp();
+
+  generation++;
+  running = workers.size();
+
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i]->operation = op;
+
+  started.notify_all();
+
+  while (running > 0)
+    finished.wait(lock);
+
+  cycle_time = timestamp() - start;
+
+  int total = 0;
+
+  for (size_t i = 0; i < workers.size(); i++)
+    total += workers[i]->result;
+
+  return total;
+
+}
+
+void ServoBusGroup::work(Worker* worker) {
+
+  if (worker->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+
+    while (worker->generation == generation)
+      started.wait(lock);
+
+    worker->generation = generation;
+    Operation op = worker->operation;
+
+    if (op == OPERATION_STOP) {
+      worker->result = 0;
+      if (--running == 0) finished.notify_all();
+      return;
+    }
+
+    lock.unlock();
+
+    int result = 0;
+
+    switch (op) {
+    case OPERATION_SCAN:
+    case OPERATION_SCAN_FORCE:
+      result = worker->bus.scan(op == OPERATION_SCAN_FORCE);
+      break;
+    case OPERATION_UPDATE:
+    case OPERATION_UPDATE_FULL:
+      result = worker->bus.update(op == OPERATION_UPDATE_FULL) ? 0 : 1;
+      break;
+    case OPERATION_FLUSH:
+      result = worker->bus.flush() ? 0 : 1;
+      break;
+    case OPERATION_REFRESH:
+    case OPERATION_REFRESH_FULL:
+      result = worker->bus.refresh(op == OPERATION_REFRESH_FULL) ? 0 : 1;
+      break;
+    default:
+      break;
+    }
+
+    lock.lock();
+
+    worker->result = result;
+
+    if (--running == 0) finished.notify_all();
+
+  }
+
+}
+
+int ServoBusGroup::scan(bool force) {
+
+  std::lock_guard<std::mutex> guard(serial);
+
+  return dispatch(force ? OPERATION_SCAN_FORCE : OPERATION_SCAN);
+
+}
+
+int ServoBusGroup::size() {
+
+  int total = 0;
+
+  for (size_t i = 0; i < workers.size(); i++)
+    total += workers[i]->bus.size();
+
+  return total;
+
+}
+
+vector<ServoLocation> ServoBusGroup::list() {
+
+  vector<ServoLocation> locations;
+
+  for (size_t i = 0; i < workers.size(); i++) {
+
+    ServoBus& bus = workers[i]->bus;
+
+    for (int j = 0; j < bus.size(); j++) {
+      ServoLocation location = {(int) i, bus.get(j)->getAddress()};
+      locations.push_back(location);
+    }
+
+  }
+
+  return locations;
+
+}
+
+ServoHandler ServoBusGroup::find(int bus, int address) {
+
+  if (bus < 0 || bus >= (int) workers.size())
+    return NULL;
+
+  return workers[bus]->bus.find(address);
+
+}
+
+ServoHandler ServoBusGroup::find(const ServoLocation& location) {
+
+  return find(location.bus, location.address);
+
+}
+
+// Update operations report failures, so the group succeeded if none failed
+bool ServoBusGroup::updateAll(bool full) {
+
+  std::lock_guard<std::mutex> guard(serial);
+
+  return dispatch(full ? OPERATION_UPDATE_FULL : OPERATION_UPDATE) == 0;
+
+}
+
+bool ServoBusGroup::flushAll() {
+
+  std::lock_guard<std::mutex> guard(serial);
+
+  return dispatch(OPERATION_FLUSH) == 0;
+
+}
+
+bool ServoBusGroup::refreshAll(bool full) {
+
+  std::lock_guard<std::mutex> guard(serial);
+
+  return dispatch(full ? OPERATION_REFRESH_FULL : OPERATION_REFRESH) == 0;
+
+}
+
+bool ServoBusGroup::getResult(int bus) const {
+
+  return workers[bus]->result == 0;
+
+}
+
+uint64_t ServoBusGroup::getCycleTime() const {
+
+  return cycle_time;
+
+}
+
+}
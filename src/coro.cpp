@@ -0,0 +1,207 @@
+#include "openservo_coro.h"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+namespace openservo {
+
+Task Task::promise_type::get_return_object() noexcept {
+
+  return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+
+}
+
+Task::Task(Task&& other) noexcept: handle(other.handle) {
+
+  other.handle = nullptr;
+
+}
+
+Task::~Task() {
+
+  if (handle) handle.destroy();
+
+}
+
+void Operation::await_suspend(std::coroutine_handle<> handle) {
+
+  waiter = handle;
+
+  switch (kind) {
+  case KIND_UPDATE:
+  case KIND_REFRESH:
+    executor->cycles.push_back(this);
+    break;
+  case KIND_SEEK:
+    executor->seeks.push_back(this);
+    break;
+  case KIND_SETTLE:
+    executor->settling.push_back(this);
+    break;
+  }
+
+}
+
+BusExecutor::BusExecutor(ServoBus& bus, int interval): bus(bus), interval(interval), refreshed(0) {
+
+}
+
+BusExecutor::~BusExecutor() {
+
+  for (size_t i = 0; i < tasks.size(); i++)
+    tasks[i].destroy();
+
+}
+
+void BusExecutor::spawn(Task task) {
+
+  tasks.push_back(task.handle);
+  ready.push_back(task.handle);
+  task.handle = nullptr;
+
+}
+
+void BusExecutor::resume(Operation* operation, bool result) {
+
+  operation->result = result;
+  ready.push_back(operation->waiter);
+
+}
+
+Operation BusExecutor::update(bool full) {
+
+  Operation operation(this, Operation::KIND_UPDATE);
+  operation.full = full;
+  return operation;
+
+}
+
+Operation BusExecutor::refresh(bool full) {
+
+  Operation operation(this, Operation::KIND_REFRESH);
+  operation.full = full;
+  return operation;
+
+}
+
+Operation BusExecutor::seek(ServoHandler servo, int position, int velocity) {
+
+  Operation operation(this, Operation::KIND_SEEK);
+  operation.servo = servo;
+  operation.position = position;
+  operation.velocity = velocity;
+  return operation;
+
+}
+
+Operation BusExecutor::waitUntilSettled(ServoHandler servo, int timeout) {
+
+  Operation operation(this, Operation::KIND_SETTLE);
+  operation.servo = servo;
+  operation.deadline = timestamp() + std::max(0, timeout);
+  return operation;
+
+}
+
+/*
+  Execute the bus operations collected in this round: seeks first since
+  they are the most time critical, then a single update (if any task awaits
+  one) or refresh shared by all waiting tasks.
+*/
+void BusExecutor::cycle() {
+
+  for (size_t i = 0; i < seeks.size(); i++)
+    resume(seeks[i], seeks[i]->servo->seekNow(seeks[i]->position, seeks[i]->velocity));
+
+  seeks.clear();
+
+  if (cycles.empty()) return;
+
+  bool write = false, full = false;
+
+  for (size_t i = 0; i < cycles.size(); i++) {
+    write |= cycles[i]->kind == Operation::KIND_UPDATE;
+    full |= cycles[i]->full;
+  }
+
+  bool result = write ? bus.update(full) : bus.refresh(full);
+
+  refreshed = timestamp();
+
+  for (size_t i = 0; i < cycles.size(); i++)
+    resume(cycles[i], result);
+
+  cycles.clear();
+
+}
+
+void BusExecutor::settle() {
+
+  if (settling.empty()) return;
+
+  uint64_t now = timestamp();
+
+  if (now - refreshed >= (uint64_t) interval) {
+    bus.refresh();
+    refreshed = now = timestamp();
+  }
+
+  vector<Operation*> waiting;
+
+  for (size_t i = 0; i < settling.size(); i++) {
+    Operation* operation = settling[i];
+    if (operation->servo->isSettled())
+      resume(operation, true);
+    else if (now >= operation->deadline)
+      resume(operation, false);
+    else
+      waiting.push_back(operation);
+  }
+
+  settling.swap(waiting);
+
+}
+
+void BusExecutor::run() {
+
+  while (!tasks.empty()) {
+
+    while (!ready.empty()) {
+      std::coroutine_handle<> handle = ready.front();
+      ready.pop_front();
+      handle.resume();
+    }
+
+    for (size_t i = 0; i < tasks.size(); ) {
+      if (tasks[i].done()) {
+        tasks[i].destroy();
+        tasks[i] = tasks.back();
+        tasks.pop_back();
+      } else {
+        i++;
+      }
+    }
+
+    cycle();
+    settle();
+
+    if (!ready.empty() || settling.empty())
+      continue;
+
+    // only settle waits are left, sleep until the next refresh or deadline
+    uint64_t wake = refreshed + interval;
+
+    for (size_t i = 0; i < settling.size(); i++)
+      wake = std::min(wake, settling[i]->deadline);
+
+    uint64_t now = timestamp();
+
+    if (wake > now)
+      usleep(wake - now);
+
+  }
+
+}
+
+}
@@ -125,6 +125,11 @@
 #define REGISTERS_RESTORE       0x87 // Restore read/write protected registers from EEPROM
 #define REGISTERS_DEFAULT       0x88 // Restore read/write protected registers to defaults
 
+#define CURVE_MOTION_ENABLE     0x90 // Enable curve based motion
+#define CURVE_MOTION_DISABLE    0x91 // Disable curve based motion
+#define CURVE_MOTION_RESET      0x92 // Clear the curve buffer
+#define CURVE_MOTION_APPEND     0x93 // Append curve registers to the curve buffer
+
 #define OS_RESET                0x80 // Reset the servo
 
 // Define the flag register REG_FLAGS_HI and REG_FLAGS_LO bits.
@@ -1,33 +1,126 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include "i2c.h"
+#include "trace.h"
 #include "debug.h"
 
 #ifdef _BUILD_MPSSE
 
 #include "mpsse.h"
 
+#include <stdio.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+extern struct vid_pid supported_devices[];
+
+/*
+ * Open the index-th supported FTDI device on the given interface, the
+ * location has the form "<interface>[:<index>]", e.g. "B" or "A:1". An empty
+ * location selects interface A of the first device.
+ */
+static mpsse_handle i2c_open_mpsse(const char *location, char *name, size_t size) {
+
+  int interface = IFACE_A;
+  int index = 0;
+  int i;
+
+  if (location && *location) {
+    char channel = toupper(location[0]);
+    if (channel < 'A' || channel > 'D')
+      return NULL;
+    interface = IFACE_A + (channel - 'A');
+    if (location[1] == ':')
+      index = atoi(location + 2);
+    else if (location[1] != 0)
+      return NULL;
+  }
+
+  const char *directory = getenv("OPENSERVO_LOCK_DIR");
+
+  if (!directory || !*directory)
+    directory = I2C_LOCK_DIR;
+
+  if (snprintf(name, size, I2C_MPSSE_LOCK, directory, 'A' + (interface - IFACE_A), index) >= (int) size)
+    return NULL;
+
+  for (i = 0; supported_devices[i].vid != 0; i++) {
+
+    mpsse_handle mpsse = OpenIndex(supported_devices[i].vid, supported_devices[i].pid, I2C,
+        ONE_HUNDRED_KHZ, MSB, interface, NULL, NULL, index);
+
+    if (mpsse && mpsse->open) {
+      mpsse->description = supported_devices[i].description;
+      return mpsse;
+    }
+
+    if (mpsse) Close(mpsse);
+
+  }
+
+  return NULL;
+}
+
+/*
+ * Open the lock file of an MPSSE channel. Symbolic links are refused and the
+ * file has to be a regular file, read access is enough for flock so the
+ * file does not have to be writable by other users.
+ */
+static int i2c_open_lock(const char *name) {
+
+  int file = open(name, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+  struct stat info;
+
+  if (file < 0)
+    return -1;
+
+  if (fstat(file, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(file);
+    errno = EPERM;
+    return -1;
+  }
+
+  return file;
+}
+
 #endif
 
 i2c_handle i2c_open(const char *filename, int type) {
 
 #ifdef _BUILD_MPSSE
   if (type == I2C_MPSSE) {
-    mpsse_handle mpsse = MPSSE(I2C, ONE_HUNDRED_KHZ, MSB);
+    char lock[256];
+    mpsse_handle mpsse = i2c_open_mpsse(filename, lock, sizeof(lock));
 
     if (!mpsse) return NULL;
 
+    // the USB device has no file to lock, all processes agree on a lock
+    // file; without one the adapter is still usable, every i2c_lock fails
+    // and the bus is used unlocked as arbitration is only advisory
+    int file = i2c_open_lock(lock);
+
+    if (file < 0) {
+      DEBUGMSG("Cannot open MPSSE lock %s, using the adapter unlocked \n", lock);
+    }
+
     DEBUGMSG("Opened MPSSE context \n");
 
     i2c_handle handle = (i2c_handle) malloc(sizeof(i2c_object));
     handle->flags = type;
     handle->selected = 0;
+    handle->last_error = 0;
     handle->data = mpsse;
+    handle->lock = file;
+    handle->transferred = 0;
     return handle;
   }
 #endif
@@ -43,8 +136,12 @@ i2c_handle i2c_open(const char *filename, int type) {
     i2c_handle handle = (i2c_handle) malloc(sizeof(i2c_object));
     handle->flags = type;
     handle->selected = 0;
+    handle->last_error = 0;
     handle->data = malloc(sizeof(int));
     ((int *) (handle->data))[0] = file;
+    handle->lock = file;
+    // I2C_RDWR does not tell how far a failed transfer got
+    handle->transferred = -1;
     return handle;
 
   }
@@ -61,10 +158,20 @@ int i2c_close(i2c_handle* handle) {
     
     Close((mpsse_handle) (*handle)->data);
 
+    if ((*handle)->lock >= 0)
+      close((*handle)->lock);
+
     free((*handle)); (*handle) = NULL;
     return 0;
   }
 #endif
+  if ((*handle)->flags == I2C_RECORD || (*handle)->flags == I2C_REPLAY) {
+
+    trace_close(*handle);
+
+    free((*handle)); (*handle) = NULL;
+    return 0;
+  }
   if ((*handle)->flags == I2C_DIRECT) {
     int file = -1;
 
@@ -82,12 +189,34 @@ int i2c_close(i2c_handle* handle) {
   return -1;
 }
 
+/* Map errno of a failed i2c-dev call to one of the I2C_* result codes */
+static int i2c_classify(i2c_handle handle, int fallback) {
+
+  handle->last_error = errno;
+
+  switch (errno) {
+  case ENXIO:
+    return I2C_ERROR_NACK_ADDRESS;
+  case EREMOTEIO:
+    return I2C_ERROR_NACK_DATA;
+  case ETIMEDOUT:
+    return I2C_ERROR_TIMEOUT;
+  case EOPNOTSUPP:
+    return I2C_ERROR_UNSUPPORTED;
+  default:
+    return fallback;
+  }
+
+}
+
 //int addr = 0x5a; // I2C address of the slave
 int i2c_select(i2c_handle handle, int address) {
 
   if (!handle)
     return -1;
 
+  handle->last_error = 0;
+
 #ifdef _BUILD_MPSSE
   if ((handle)->flags == I2C_MPSSE) {
     
@@ -96,9 +225,12 @@ int i2c_select(i2c_handle handle, int address) {
     return 0;
   }
 #endif
+  if ((handle)->flags == I2C_RECORD || (handle)->flags == I2C_REPLAY)
+    return trace_select(handle, address);
+
   if ((handle)->flags == I2C_DIRECT) {
     if (ioctl(*((int*)(handle)->data), I2C_SLAVE, address) < 0) {
-      // ERROR HANDLING: you can chech error no. to see what went wrong
+      handle->last_error = errno;
       return -1;
     }
     return 0;
@@ -108,7 +240,7 @@ int i2c_select(i2c_handle handle, int address) {
 
 int i2c_read(i2c_handle handle, unsigned char* buffer, int length) {
 
-  char* data;
+  char nack;
 
   if (!handle)
     return -1;
@@ -121,36 +253,33 @@ int i2c_read(i2c_handle handle, unsigned char* buffer, int length) {
     Start((mpsse_handle) (handle)->data);
     Write((mpsse_handle) (handle)->data, &address, 1);
 
-    if (GetAck((mpsse_handle) (handle)->data) != ACK) return -2;
+    if (GetAck((mpsse_handle) (handle)->data) != ACK) return I2C_ERROR_NACK_ADDRESS;
 
     SendAcks((mpsse_handle) (handle)->data);
 
-    data = Read((mpsse_handle) (handle)->data, length);
-
-    if (data == NULL) return -1;
-
-    memcpy(buffer, data, length);
-
-    free(data);
+    if (ReadInto((mpsse_handle) (handle)->data, (char*) buffer, length) != MPSSE_OK) return I2C_ERROR;
 
     SendNacks((mpsse_handle) (handle)->data);
 
-    Read((mpsse_handle) (handle)->data, 1);
+    ReadInto((mpsse_handle) (handle)->data, &nack, 1);
 
     Stop((mpsse_handle) (handle)->data);
 
     return 0;
   }
 #endif
+  if ((handle)->flags == I2C_RECORD || (handle)->flags == I2C_REPLAY)
+    return trace_read(handle, buffer, length);
+
   if ((handle)->flags == I2C_DIRECT) {
     // read() returns the number of bytes actually read, if 
     // it doesn't match, then an error occurred (e.g. no 
     // response from the device)
-    if (read(*((int*)(handle)->data), buffer, length) != length) 
-    {
-      // ERROR HANDLING: i2c transaction failed
-      return -1;
-    }
+    int n = read(*((int*)(handle)->data), buffer, length);
+    if (n < 0)
+      return i2c_classify(handle, I2C_ERROR);
+    if (n != length)
+      return I2C_ERROR_SHORT;
     return 0;
   }
   return -1;
@@ -169,26 +298,144 @@ int i2c_write(i2c_handle handle, unsigned char* buffer, int length) {
     Start((mpsse_handle) (handle)->data);
     Write((mpsse_handle) (handle)->data, &address, 1);
 
-    if (GetAck((mpsse_handle) (handle)->data) != ACK) return -2;
+    if (GetAck((mpsse_handle) (handle)->data) != ACK) return I2C_ERROR_NACK_ADDRESS;
 
     Write((mpsse_handle) (handle)->data, buffer, length);
 
-    if (GetAck((mpsse_handle) (handle)->data) != ACK) return -3;
+    if (GetAck((mpsse_handle) (handle)->data) != ACK) return I2C_ERROR_NACK_DATA;
 
     Stop((mpsse_handle) (handle)->data);
 
     return 0;
   }
 #endif
+  if ((handle)->flags == I2C_RECORD || (handle)->flags == I2C_REPLAY)
+    return trace_write(handle, buffer, length);
+
   if ((handle)->flags == I2C_DIRECT) {
-    if (write(*((int*)(handle)->data), buffer, length) != length)
-    {
-      // ERROR HANDLING: i2c transaction failed
-      return -4;
+    int n = write(*((int*)(handle)->data), buffer, length);
+    if (n < 0)
+      return i2c_classify(handle, I2C_ERROR_TRANSFER);
+    if (n != length)
+      return I2C_ERROR_SHORT;
+    return 0;
+  }
+  return I2C_ERROR_TYPE;
+}
+
+/*
+ * Combined transfer of several messages, possibly to different addresses,
+ * with repeated starts in between and a single stop at the end.
+ */
+int i2c_transfer(i2c_handle handle, i2c_message* messages, int count) {
+
+  int i;
+
+  if (!handle)
+    return -1;
+
+  handle->last_error = 0;
+
+#ifdef _BUILD_MPSSE
+  if ((handle)->flags == I2C_MPSSE) {
+
+    mpsse_handle mpsse = (mpsse_handle) (handle)->data;
+    char nack;
+
+    handle->transferred = 0;
+
+    for (i = 0; i < count; i++) {
+
+      char address = (messages[i].address << 1) + (messages[i].read ? 1 : 0);
+
+      Start(mpsse);
+      Write(mpsse, &address, 1);
+
+      if (GetAck(mpsse) != ACK) {
+        Stop(mpsse);
+        return I2C_ERROR_NACK_ADDRESS;
+      }
+
+      if (messages[i].read) {
+
+        SendAcks(mpsse);
+
+        if (ReadInto(mpsse, (char*) messages[i].buffer, messages[i].length) != MPSSE_OK) {
+          Stop(mpsse);
+          return I2C_ERROR;
+        }
+
+        SendNacks(mpsse);
+
+        ReadInto(mpsse, &nack, 1);
+
+      } else {
+
+        Write(mpsse, (char*) messages[i].buffer, messages[i].length);
+
+        if (GetAck(mpsse) != ACK) {
+          Stop(mpsse);
+          return I2C_ERROR_NACK_DATA;
+        }
+
+      }
+
+      handle->transferred++;
+    }
+
+    Stop(mpsse);
+
+    return 0;
+  }
+#endif
+  if ((handle)->flags == I2C_RECORD || (handle)->flags == I2C_REPLAY)
+    return trace_transfer(handle, messages, count);
+
+  if ((handle)->flags == I2C_DIRECT) {
+
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct i2c_rdwr_ioctl_data transaction;
+
+    while (count > 0) {
+
+      int n = count > I2C_RDWR_IOCTL_MAX_MSGS ? I2C_RDWR_IOCTL_MAX_MSGS : count;
+
+      for (i = 0; i < n; i++) {
+        msgs[i].addr = messages[i].address;
+        msgs[i].flags = messages[i].read ? I2C_M_RD : 0;
+        msgs[i].buf = messages[i].buffer;
+        msgs[i].len = messages[i].length;
+      }
+
+      transaction.msgs = msgs;
+      transaction.nmsgs = n;
+
+      int r = ioctl(*((int*)(handle)->data), I2C_RDWR, &transaction);
+      if (r < 0)
+        return i2c_classify(handle, I2C_ERROR_TRANSFER);
+      if (r != n)
+        return I2C_ERROR_SHORT;
+
+      messages += n;
+      count -= n;
     }
+
     return 0;
   }
-  return -5;
+  return I2C_ERROR_TYPE;
+}
+
+/*
+ * Number of leading messages the last i2c_transfer delivered, so that a
+ * failed combined transfer can be completed without repeating them. Returns
+ * -1 for transports that can not tell.
+ */
+int i2c_transferred(i2c_handle handle) {
+
+  if (!handle)
+    return -1;
+
+  return handle->transferred;
 }
 
 //---- SCAN ADDRESSES ----
@@ -211,3 +458,123 @@ int i2c_scan(i2c_handle handle, unsigned char* addr) {
   }
   return count;
 }
+
+int i2c_get_error(i2c_handle handle) {
+
+  if (!handle)
+    return -1;
+
+  return handle->last_error;
+}
+
+/* Limit the time a single transfer may block, timeout is in microseconds */
+int i2c_timeout(i2c_handle handle, int timeout) {
+
+  if (!handle || timeout < 1)
+    return -1;
+
+#ifdef _BUILD_MPSSE
+  if ((handle)->flags == I2C_MPSSE) {
+
+    mpsse_handle mpsse = (mpsse_handle) (handle)->data;
+
+    // libftdi bulk transfer timeouts are given in milliseconds
+    mpsse->ftdi.usb_read_timeout = (timeout + 999) / 1000;
+    mpsse->ftdi.usb_write_timeout = (timeout + 999) / 1000;
+
+    return 0;
+  }
+#endif
+  if ((handle)->flags == I2C_RECORD || (handle)->flags == I2C_REPLAY)
+    return trace_timeout(handle, timeout);
+
+  if ((handle)->flags == I2C_DIRECT) {
+    // i2c-dev timeout is given in units of 10 ms
+    if (ioctl(*((int*)(handle)->data), I2C_TIMEOUT, (timeout + 9999) / 10000) < 0) {
+      handle->last_error = errno;
+      return -1;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Take the advisory lock that serializes bus access between processes. The
+ * lock is tried without blocking first, if another process holds it the call
+ * returns I2C_ERROR_BUSY when timeout is 0. Otherwise it waits up to timeout
+ * microseconds, or without limit when timeout is negative, and returns
+ * I2C_LOCK_CONTENDED once the lock is acquired or I2C_ERROR_TIMEOUT.
+ */
+int i2c_lock(i2c_handle handle, int timeout) {
+
+  struct timespec start, now;
+  useconds_t delay = I2C_LOCK_POLL;
+  int contended = 0;
+
+  if (!handle || handle->lock < 0)
+    return I2C_ERROR;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (flock(handle->lock, LOCK_EX | LOCK_NB) != 0) {
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno != EWOULDBLOCK) {
+      handle->last_error = errno;
+      return I2C_ERROR;
+    }
+
+    if (timeout == 0)
+      return I2C_ERROR_BUSY;
+
+    if (timeout < 0) {
+
+      while (flock(handle->lock, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+          handle->last_error = errno;
+          return I2C_ERROR;
+        }
+      }
+
+      return I2C_LOCK_CONTENDED;
+    }
+
+    // flock can not wait with a time limit, poll with a growing interval
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+
+    if (waited >= timeout) {
+      handle->last_error = EWOULDBLOCK;
+      return I2C_ERROR_TIMEOUT;
+    }
+
+    if (delay > (useconds_t) (timeout - waited))
+      delay = timeout - waited;
+
+    usleep(delay);
+
+    if (delay < I2C_LOCK_POLL_LIMIT)
+      delay *= 2;
+
+    contended = 1;
+  }
+
+  return contended ? I2C_LOCK_CONTENDED : I2C_OK;
+}
+
+int i2c_unlock(i2c_handle handle) {
+
+  if (!handle || handle->lock < 0)
+    return I2C_ERROR;
+
+  if (flock(handle->lock, LOCK_UN) != 0) {
+    handle->last_error = errno;
+    return I2C_ERROR;
+  }
+
+  return I2C_OK;
+}
@@ -4,6 +4,35 @@
 
 #define I2C_DIRECT 0
 #define I2C_MPSSE 1
+#define I2C_RECORD 2
+#define I2C_REPLAY 3
+
+#define I2C_OK 0
+#define I2C_ERROR -1
+#define I2C_ERROR_NACK_ADDRESS -2
+#define I2C_ERROR_NACK_DATA -3
+#define I2C_ERROR_TRANSFER -4
+#define I2C_ERROR_TYPE -5
+#define I2C_ERROR_TIMEOUT -6
+#define I2C_ERROR_SHORT -7
+#define I2C_ERROR_UNSUPPORTED -8
+#define I2C_ERROR_BUSY -9
+
+// returned by i2c_lock when the lock was held by another process
+#define I2C_LOCK_CONTENDED 1
+
+// interval in microseconds at which a bounded i2c_lock retries, doubled up
+// to the limit while the lock stays held
+#define I2C_LOCK_POLL 50
+#define I2C_LOCK_POLL_LIMIT 1000
+
+// advisory lock shared by all processes using an MPSSE adapter, one per
+// interface and device index, created in I2C_LOCK_DIR unless the
+// OPENSERVO_LOCK_DIR environment variable names another directory
+#ifndef I2C_LOCK_DIR
+#define I2C_LOCK_DIR "/run/lock"
+#endif
+#define I2C_MPSSE_LOCK "%s/openservo-mpsse-%c%d.lock"
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,17 +43,36 @@ typedef struct i2c_object {
 	int selected;
     int flags;
     int last_error;
+    int lock;
+    int transferred;
 } i2c_object;
 
 typedef i2c_object* i2c_handle;
 
+/* Single message of a combined transfer */
+typedef struct i2c_message {
+    int address;
+    int read;
+    unsigned char* buffer;
+    int length;
+} i2c_message;
+
 i2c_handle i2c_open(const char *filename, int type);
 int i2c_close(i2c_handle* handle);
 int i2c_select(i2c_handle handle, int address);
 int i2c_read(i2c_handle handle, unsigned char* buffer, int length);
 int i2c_write(i2c_handle handle, unsigned char* buffer, int length);
+int i2c_transfer(i2c_handle handle, i2c_message* messages, int count);
+int i2c_transferred(i2c_handle handle);
 int i2c_scan(i2c_handle handle, unsigned char* addr);
 int i2c_get_error(i2c_handle handle);
+int i2c_timeout(i2c_handle handle, int timeout);
+int i2c_lock(i2c_handle handle, int timeout);
+int i2c_unlock(i2c_handle handle);
+
+// record/replay transports, see trace.h
+i2c_handle i2c_record(const char* trace, i2c_handle inner);
+i2c_handle i2c_replay(const char* trace, double speed);
 
 #ifdef __cplusplus
 }
@@ -99,7 +99,7 @@ uint32_t div2freq(uint32_t system_clock, uint16_t div)
 	return (system_clock / ((1 + div) * 2));
 }
 
-/* Builds a buffer of commands + data blocks */
+/* Builds a buffer of commands + data blocks in the scratch buffer of the context, which grows as needed and must not be freed by the caller */
 unsigned char *build_block_buffer(struct mpsse_context *mpsse, uint8_t cmd, unsigned char *data, int size, int *buf_size)
 {
 	unsigned char *buf = NULL;
@@ -133,7 +133,17 @@ unsigned char *build_block_buffer(struct mpsse_context *mpsse, uint8_t cmd, unsi
 		total_size += (CMD_SIZE * 3 * num_blocks);
 	}
 
-	buf = malloc(total_size);
+	if (total_size > mpsse->scratch_size)
+	{
+		buf = realloc(mpsse->scratch, total_size);
+		if (buf)
+		{
+			mpsse->scratch = buf;
+			mpsse->scratch_size = total_size;
+		}
+	}
+
+	buf = (total_size <= mpsse->scratch_size) ? mpsse->scratch : NULL;
 	if (buf)
 	{
 		memset(buf, 0, total_size);
@@ -501,6 +511,7 @@ void Close(struct mpsse_context *mpsse)
 			ftdi_deinit(&mpsse->ftdi);
 		}
 
+		free(mpsse->scratch);
 		free(mpsse);
 		mpsse = NULL;
 	}
@@ -1042,7 +1053,6 @@ int Write(struct mpsse_context *mpsse, char *data, int size)
 				{
 					retval = raw_write(mpsse, buf, buf_size);
 					n += txsize;
-					free(buf);
 
 					if (retval == MPSSE_FAIL)
 					{
@@ -1071,57 +1081,85 @@ int Write(struct mpsse_context *mpsse, char *data, int size)
 	return retval;
 }
 
-/* Performs a read. For internal use only; see Read() and ReadBits(). */
-char *InternalRead(struct mpsse_context *mpsse, int size)
+/* Performs a read into a caller provided buffer. For internal use only; see ReadInto(), Read() and ReadBits(). */
+int InternalReadInto(struct mpsse_context *mpsse, unsigned char *buf, int size)
 {
-	unsigned char *data = NULL, *buf = NULL;
+	unsigned char *data = NULL;
 	unsigned char sbuf[SPI_RW_SIZE] = { 0 };
-	int n = 0, rxsize = 0, data_size = 0, retval = 0;
+	int n = 0, rxsize = 0, data_size = 0, retval = MPSSE_FAIL;
 
 	if (is_valid_context(mpsse))
 	{
 		if (mpsse->mode)
 		{
-			buf = malloc(size);
-			if (buf)
+			memset(buf, 0, size);
+
+			while (n < size)
 			{
-				memset(buf, 0, size);
+				rxsize = size - n;
+				if (rxsize > mpsse->xsize)
+				{
+					rxsize = mpsse->xsize;
+				}
 
-				while (n < size)
+				data = build_block_buffer(mpsse, mpsse->rx, sbuf, rxsize, &data_size);
+				if (data)
 				{
-					rxsize = size - n;
-					if (rxsize > mpsse->xsize)
-					{
-						rxsize = mpsse->xsize;
-					}
+					retval = raw_write(mpsse, data, data_size);
 
-					data = build_block_buffer(mpsse, mpsse->rx, sbuf, rxsize, &data_size);
-					if (data)
+					if (retval == MPSSE_OK)
 					{
-						retval = raw_write(mpsse, data, data_size);
-						free(data);
-
-						if (retval == MPSSE_OK)
-						{
-							n += raw_read(mpsse, buf + n, rxsize);
-						}
-						else
-						{
-							break;
-						}
+						n += raw_read(mpsse, buf + n, rxsize);
 					}
 					else
 					{
 						break;
 					}
 				}
+				else
+				{
+					retval = MPSSE_FAIL;
+					break;
+				}
 			}
 		}
 	}
 
+	return retval;
+}
+
+/* Performs a read into a newly allocated buffer. For internal use only; see Read() and ReadBits(). */
+char *InternalRead(struct mpsse_context *mpsse, int size)
+{
+	unsigned char *buf = NULL;
+
+	if (is_valid_context(mpsse) && mpsse->mode)
+	{
+		buf = malloc(size);
+		if (buf)
+		{
+			InternalReadInto(mpsse, buf, size);
+		}
+	}
+
 	return (char *) buf;
 }
 
+/*
+ * Reads data over the selected serial protocol into a caller provided
+ * buffer, without allocating.
+ *
+ * @mpsse - MPSSE context pointer.
+ * @data  - Buffer receiving at least size bytes.
+ * @size  - Number of bytes to read.
+ *
+ * Returns MPSSE_OK on success, MPSSE_FAIL on failure.
+ */
+int ReadInto(struct mpsse_context *mpsse, char *data, int size)
+{
+	return InternalReadInto(mpsse, (unsigned char *) data, size);
+}
+
 /*
  * Reads data over the selected serial protocol.
  *
@@ -1229,7 +1267,6 @@ char *Transfer(struct mpsse_context *mpsse, char *data, int size)
 					if (txdata)
 					{
 						retval = raw_write(mpsse, txdata, data_size);
-						free(txdata);
 
 						if (retval == MPSSE_OK)
 						{
@@ -166,6 +166,8 @@ struct mpsse_context
 	uint8_t txrx;
 	uint8_t tack;
 	uint8_t rack;
+	unsigned char *scratch;		/* command buffer reused by build_block_buffer */
+	int scratch_size;
 };
 
 typedef struct mpsse_context* mpsse_handle;
@@ -187,6 +189,7 @@ void SetCSIdle(struct mpsse_context *mpsse, int idle);
 int Start(struct mpsse_context *mpsse);
 int Write(struct mpsse_context *mpsse, char *data, int size);
 char *Read(struct mpsse_context *mpsse, int size);
+int ReadInto(struct mpsse_context *mpsse, char *data, int size);
 int Stop(struct mpsse_context *mpsse);
 int GetAck(struct mpsse_context *mpsse);
 void SetAck(struct mpsse_context *mpsse, int ack);
@@ -1,20 +1,57 @@
 #include "openservo.h"
+#include "openservo_telemetry.h"
 #include "i2c.h"
 #include "defines.h"
 #include "debug.h"
 
 #include <map>
 #include <algorithm>
+#include <iterator>
 #include <string> 
 
-#include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
 
 namespace openservo {
 
 #define REGISTER_READONLY 1
 #define REGISTER_PROTECTED 2
 
+#define WATCH_CHANGE 0
+#define WATCH_THRESHOLD 1
+#define WATCH_FLAGS 2
+
+// Result of a transaction that was not attempted because the cycle budget ran out
+#define BUS_BUDGET_EXCEEDED -100
+// Result of a checked transaction that kept failing checksum validation
+#define BUS_CHECKSUM_MISMATCH -101
+
+// Data bytes per checked transaction, the rest of the servo buffer is taken
+// by the command, address, length and checksum bytes
+#define CHECKED_WRITE_BLOCK (I2C_MAX_DATA_LEN - 4)
+#define CHECKED_READ_BLOCK (I2C_MAX_DATA_LEN - 1)
+
+// Skipped registers between two read ranges that are still read in one
+// transaction, roughly the cost of the address and register bytes of a read.
+// Calibrated buses derive the gap from their cost model instead.
+#define READ_MERGE_GAP 3
+
+// Transaction sizes measured by ServoBus::calibrate
+#define CALIBRATION_SIZES 5
+// first of the unused write protected registers, the firmware discards
+// writes there while write access is disabled
+#define CALIBRATION_SCRATCH 0x40
+
+#define GENERAL_CALL_ADDRESS 0x00
+
+// Status refresh interval while waiting for a servo to settle without a poller
+#define SETTLE_INTERVAL 2000
+
 class Register {
 public:
   Register(int address, int length, int flags = 0): address(address),
@@ -48,6 +85,12 @@ map<string, Register> _registers = {
   {"seek", Register(SEEK_HI, 2)},
   {"seek.velocity", Register(SEEK_VELOCITY_HI, 2)},
   {"voltage", Register(VOLTAGE_HI, 2)},
+  {"curve.reserved", Register(CURVE_RESERVED, 1, REGISTER_READONLY)},
+  {"curve.buffer", Register(CURVE_BUFFER, 1, REGISTER_READONLY)},
+  {"curve.delta", Register(CURVE_DELTA_HI, 2)},
+  {"curve.position", Register(CURVE_POSITION_HI, 2)},
+  {"curve.velocity.in", Register(CURVE_IN_VELOCITY_HI, 2)},
+  {"curve.velocity.out", Register(CURVE_OUT_VELOCITY_HI, 2)},
 
 
   {"address", Register(TWI_ADDRESS, 1, REGISTER_PROTECTED)},
@@ -66,13 +109,212 @@ map<string, Register> _registers = {
 
   };
 
-Servo::Servo(ServoBus* bus, int address): bus(bus), locked(true) {
+BusPolicy::BusPolicy(): deadline(0), backoff(0), backoff_limit(10000), budget(0) {
+
+  retries[TRANSACTION_COMMAND] = 0;
+  retries[TRANSACTION_WRITE] = 0;
+  retries[TRANSACTION_READ] = 0;
+
+}
+
+RealtimeConfig::RealtimeConfig(): policy(SCHED_OTHER), priority(0), cpu(-1),
+  lock_memory(false) {
+
+}
+
+BusMutex::BusMutex() {
+
+  pthread_mutexattr_t attributes;
+
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutexattr_setprotocol(&attributes, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&handle, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+
+}
+
+BusMutex::~BusMutex() {
+
+  pthread_mutex_destroy(&handle);
+
+}
+
+void BusMutex::lock() {
+
+  pthread_mutex_lock(&handle);
+
+}
+
+bool BusMutex::try_lock() {
+
+  return pthread_mutex_trylock(&handle) == 0;
+
+}
+
+void BusMutex::unlock() {
+
+  pthread_mutex_unlock(&handle);
+
+}
+
+static bool apply_realtime(pthread_t thread, const RealtimeConfig& config) {
+
+  bool success = true;
+
+  struct sched_param param;
+  param.sched_priority = config.priority;
+
+  if (pthread_setschedparam(thread, config.policy, &param) != 0)
+    success = false;
+
+  if (config.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(config.cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+      success = false;
+  }
+
+  return success;
+
+}
+
+CostModel::CostModel(): calibrated(false) {
+
+  for (int i = 0; i < 3; i++) {
+    overhead[i] = 0;
+    per_byte[i] = 0;
+  }
+
+}
+
+uint64_t timestamp() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+UpdateStatus update_status(int result) {
+
+  switch (result) {
+  case I2C_OK:
+    return UPDATE_OK;
+  case I2C_ERROR_NACK_ADDRESS:
+  case I2C_ERROR_NACK_DATA:
+    return UPDATE_NAK;
+  case I2C_ERROR_TIMEOUT:
+    return UPDATE_TIMEOUT;
+  case I2C_ERROR_SHORT:
+    return UPDATE_SHORT_READ;
+  case BUS_BUDGET_EXCEEDED:
+    return UPDATE_ABORTED;
+  case BUS_CHECKSUM_MISMATCH:
+    return UPDATE_CORRUPTED;
+  default:
+    return UPDATE_BUS_ERROR;
+  }
+
+}
+
+struct Servo::History {
+
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    Sample sample;
+  };
+
+  History(int capacity): capacity(capacity), slots(new Slot[capacity]), head(0) {
+    for (int i = 0; i < capacity; i++)
+      slots[i].sequence = 0;
+  }
+
+  int capacity;
+  std::unique_ptr<Slot[]> slots;
+  std::atomic<uint64_t> head;
+
+  int channels;
+  int address[HISTORY_CHANNELS];
+  int length[HISTORY_CHANNELS];
+
+};
+
+// Holds the inter-process bus lock for the lifetime of a scope
+struct ServoBus::Arbitration {
+
+  Arbitration(ServoBus* bus, BusLocking scope): bus(bus), scope(scope) {
+    bus->acquire(scope);
+  }
+
+  ~Arbitration() {
+    bus->release(scope);
+  }
+
+  ServoBus* bus;
+  BusLocking scope;
+
+};
+
+struct ServoBus::Scheduler {
+
+  struct Job {
+    ServoHandler servo;
+    ScheduledOperation operation;
+    Priority priority;
+    uint64_t deadline;
+    unsigned long sequence;
+    bool held;            // already reported as held back for a quarantined servo
+  };
+
+  Scheduler(): sequence(0) {
+    memset(estimate, 0, sizeof(estimate));
+    memset(&statistics, 0, sizeof(statistics));
+  }
+
+  vector<Job> queue;
+  vector<Job> running;
+  vector<Job> deferred;
+  unsigned long sequence;
+
+  // running average of the duration of each operation in microseconds
+  uint64_t estimate[SCHEDULE_OPERATIONS];
+
+  SchedulerStatistics statistics;
+
+  // Most urgent first: priority class, then earliest deadline, then arrival
+  static bool order(const Job& a, const Job& b) {
+
+    if (a.priority != b.priority)
+      return a.priority < b.priority;
+
+    if (a.deadline != b.deadline)
+      return a.deadline && (!b.deadline || a.deadline < b.deadline);
+
+    return a.sequence < b.sequence;
+
+  }
+
+};
+
+Servo::Servo(ServoBus* bus, int address): bus(bus), responsive(true),
+  failures(0), status(UPDATE_OK), sampled(0), locked(true), session(false),
+  session_expires(0), curve(false), watch_counter(0), notifying(false),
+  recorder(NULL) {
+
+  updated = false;
 
   for (int i = 0; i < SERVO_MAX_SPACE; i++) {
     local[i] = false;
+    written[i] = false;
     data[i] = 0;
+    confirmed[i] = 0;
   }
 
+  memset(previous, 0, sizeof(previous));
+
   data[TWI_ADDRESS] = address;
 
   update(true);
@@ -107,6 +349,38 @@ void Servo::unlock() {
 
 }
 
+bool Servo::beginSession(int timeout) {
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  if (session) return true;
+
+  if (!command(WRITE_ENABLE)) {
+    bus->error(ERROR_WRITE_ENABLE, getAddress());
+    return false;
+  }
+
+  session = true;
+  session_expires = timeout > 0 ? timestamp() + timeout : 0;
+  locked = false;
+
+  return true;
+
+}
+
+bool Servo::endSession() {
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  if (!session) return true;
+
+  session = false;
+  locked = true;
+
+  return command(WRITE_DISABLE);
+
+}
+
 bool Servo::registersCommit() {
 
   return command(REGISTERS_SAVE);
@@ -137,49 +411,49 @@ void Servo::print(ostream& out) const {
 
 int Servo::getType() {
   
-  return get("type");
+  return fetch(DEVICE_TYPE, 1);
 
 }
 
 int Servo::getSubType() {
 
-  return get("subtype");
+  return fetch(DEVICE_SUBTYPE, 1);
   
 }
 
 pair<int, int> Servo::getVersion() {
 
-  return pair<int, int>(get("version.major"), get("version.minor"));
+  return pair<int, int>(fetch(VERSION_MAJOR, 1), fetch(VERSION_MINOR, 1));
   
 }
 
 int Servo::getFlags() {
 
-  return get("flags");
+  return fetch(FLAGS_HI, 2);
   
 }
 
 int Servo::getTimer() {
 
-  return get("timer");
+  return fetch(TIMER_HI, 2);
   
 }
 
 int Servo::getPosition() {
 
-  return get("position");
+  return fetch(POSITION_HI, 2);
   
 }
 
 int Servo::getVelocity() {
 
-  return get("velocity");
+  return fetch(VELOCITY_HI, 2);
   
 }
 
 int Servo::getPower() {
 
-  return get("power");
+  return fetch(POWER_HI, 2);
   
 }
 
@@ -191,43 +465,61 @@ int Servo::getPWM() {
 
 int Servo::getSeekPosition() {
 
-  return get("seek");
+  return fetch(SEEK_HI, 2);
   
 }
 
 int Servo::getSeekVelocity() {
   
-  return get("seek.velocity");
+  return fetch(SEEK_VELOCITY_HI, 2);
+
+}
+
+int Servo::getCurveInVelocity() {
+
+  return fetch(CURVE_IN_VELOCITY_HI, 2);
+
+}
+
+int Servo::getCurveOutVelocity() {
+
+  return fetch(CURVE_OUT_VELOCITY_HI, 2);
+
+}
+
+int Servo::getCurveBuffer() {
+
+  return fetch(CURVE_BUFFER, 1);
 
 }
 
 int Servo::getAddress() {
 
-  return get("address");
+  return fetch(TWI_ADDRESS, 1);
 
 }
 
 int Servo::getMinSeek()  {
 
-  return get("seek.min");
+  return fetch(MIN_SEEK_HI, 2);
 
 }
 
 int Servo::getMaxSeek()  {
 
-  return get("seek.max");
+  return fetch(MAX_SEEK_HI, 2);
 
 }
 
 void Servo::setSeekPosition(int value) {
 
-  set("seek", value);
+  store(SEEK_HI, 2, value);
 
 }
 
 void Servo::setSeekVelocity(int value) {
 
-  set("seek.velocity", value);
+  store(SEEK_VELOCITY_HI, 2, value);
 
 }
 
@@ -250,6 +542,10 @@ string Servo::normalize(const string& name) const {
 
 int Servo::get(const string& name) const {
 
+  if (!bus) return 0;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
   string nname = normalize(name);
 
   std::map<string, Register>::iterator reg;
@@ -268,6 +564,8 @@ int Servo::get(const string& name) const {
 
 bool Servo::set(const string& name, int value) {
 
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
   string nname = normalize(name);
 
   std::map<string, Register>::iterator reg;
@@ -297,6 +595,18 @@ vector<string> Servo::list() const {
   return names;
 }
 
+string Servo::getName(int address) const {
+
+  for(std::map<string, Register>::const_iterator it = _registers.begin();
+    it != _registers.end(); ++it) {
+    if (it->second.address == address)
+      return it->first;
+  }
+
+  return string();
+
+}
+
 bool Servo::exists(const string& name) const {
 
   string nname = normalize(name);
@@ -336,6 +646,29 @@ bool Servo::isProtected(const string& name) const {
 
 }
 
+int Servo::fetch(int address, int length) const {
+
+  if (!bus) return 0;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  return length == 1 ? read1B(address) : read2B(address);
+
+}
+
+void Servo::store(int address, int length, int value) {
+
+  if (!bus) return;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  if (length == 1)
+    write1B(address, value);
+  else
+    write2B(address, value);
+
+}
+
 int Servo::read2B(const int address) const {
   int value = 0;
 
@@ -360,15 +693,32 @@ void Servo::write2B(const int address, int value) {
   data[address+1] = (unsigned char)value;
   data[address] = (unsigned char)(value >> 8);
 
-  local[address+1] = true;
-  local[address] = true;
+  // Both bytes are written together, skip them if the servo already has them
+  bool changed = !updated || data[address] != confirmed[address] ||
+    data[address+1] != confirmed[address+1];
+
+  local[address+1] = changed;
+  local[address] = changed;
 
 }
 
 void Servo::write1B(const int address, int value) {
 
   data[address] = (unsigned char)value;
-  local[address] = true;
+  local[address] = !updated || data[address] != confirmed[address];
+
+}
+
+/*
+  Mark a register range as successfully written to the servo.
+*/
+void Servo::confirm(int from, int to) {
+
+  for (int i = from; i <= to; i++) {
+    confirmed[i] = data[i];
+    written[i] = true;
+    local[i] = false;
+  }
 
 }
 
@@ -376,6 +726,8 @@ bool Servo::command(unsigned char cmd) {
 
   if (!bus) return false;
 
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
   return bus->send(getAddress(), cmd, NULL, 0);
 
 }
@@ -384,15 +736,35 @@ bool Servo::update(bool full) {
 
   if (!bus) return false;
 
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  if (!flush()) return false;
+
+  return refresh(full);
+
+}
+
+/*
+  Write all locally modified registers to the servo.
+*/
+bool Servo::flush() {
+
+  if (!bus) return false;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
   int i = 0;
 
   int address = getAddress();
 
-  if (!locked) {
+  // Unlocked servos outside of a write session get a write enable bracket
+  bool bracket = !locked && !session;
+
+  if (bracket) {
 
       if (!command(WRITE_ENABLE)) {
-        bus->setLastError("Unable to enable write access to address %d", address);
-        return false;
+        bus->error(ERROR_WRITE_ENABLE, address);
+        return health(false);
       } 
 
   }
@@ -401,160 +773,2257 @@ bool Servo::update(bool full) {
 
     int start = i;
 
-    while (local[i]) {
-      local[i] = false;
+    while (i < SERVO_MAX_SPACE && local[i])
       i++;
-    }
 
     if (start < i) {
       if (!bus->send(address, start, &data[start], i - start)) {
-        bus->setLastError("Unable to send registers %d to %d to address %d.", start, i, address);
-        return false;
+        bus->error(ERROR_SEND, address, start, i - 1);
+        return health(false);
       } 
+      confirm(start, i - 1);
     }
 
     i++;
 
   }
 
-  if (!locked) {
+  if (bracket) {
 
       if (!command(WRITE_DISABLE)) {
-        bus->setLastError("Unable to disable write access to address %d", address);
-        return false;
+        bus->error(ERROR_WRITE_DISABLE, address);
+        return health(false);
       } 
       locked = true;
 
   }
 
-  int from = full ? 0 : FLAGS_HI;
-  int to = full ? CURRENT_SOFT_CUT_OFF_LO : VOLTAGE_LO;
-
-  int data_length = to - from + 1;
-  if (!bus->receive(address, from, &data[from], data_length)) {
-    bus->setLastError("Unable to read registers %d to %d from address %d.", from, from + data_length, address);
-    return false;
-  } 
-
-  for (i = from; i < to + 1; i++) {
-    local[i] = false;
+  if (!expire()) {
+    bus->error(ERROR_WRITE_DISABLE, address);
+    return health(false);
   }
 
+  if (!stream())
+    return health(false);
+
   return true;
 }
 
-string ServoBus::getLastError() {
-
-  string m = errormessage;
-  errormessage = "";
-  return m;
-
-}
+/*
+  Read the status registers (or all registers if full is set) from the servo.
+  Registers that were modified locally but not flushed yet are kept.
+*/
+bool Servo::refresh(bool full) {
 
-void ServoBus::setLastError(const string& message, ...) {
+  if (!bus) return false;
 
-  int final_n, n = ((int)message.size()) * 2; /* Reserve two times as much as the length of the message */
-    std::unique_ptr<char[]> formatted;
-    va_list ap;
-    while(1) {
-        formatted.reset(new char[n]); /* Wrap the plain char array into the unique_ptr */
-        strcpy(&formatted[0], message.c_str());
-        va_start(ap, message);
-        final_n = vsnprintf(&formatted[0], n, message.c_str(), ap);
-        va_end(ap);
-        if (final_n < 0 || final_n >= n)
-            n += abs(final_n - n + 1);
-        else
-            break;
-    }
-    errormessage = std::string(formatted.get());
-}
+  std::lock_guard<BusMutex> lock(bus->mutex);
 
-ServoBus::ServoBus() {
+  int address = getAddress();
 
-  if (__is_debug_enabled())
-    __debug_enable();
+  int from = full ? 0 : FLAGS_HI;
+  int to = full ? CURRENT_SOFT_CUT_OFF_LO : (curve ? CURVE_BUFFER : VOLTAGE_LO);
 
-  handle = NULL;
+  unsigned char buffer[SERVO_MAX_SPACE];
 
-}
+  int merge = bus->mergeGap();
 
-ServoBus::~ServoBus() {
+  // Registers written in this cycle are already known, with elision enabled
+  // they are left out of the read unless they sit inside a short gap.
+  bool skip[SERVO_MAX_SPACE];
+  for (int i = from; i <= to; i++)
+    skip[i] = bus->elision && written[i];
 
-  close();
+  int i = from;
 
-}
+  while (i <= to) {
 
+    while (i <= to && skip[i])
+      i++;
 
-bool ServoBus::open(const string& port) {
+    if (i > to) break;
 
-  if (handle) close();
+    int start = i, end = i;
 
-#ifdef _BUILD_MPSSE
-  if (port.empty()) {
-    if ((handle = i2c_open(NULL, I2C_MPSSE)) == NULL) {
-      setLastError("Cannot open MPSSE device");
-      return false;
+    while (i <= to) {
+      if (!skip[i]) {
+        end = i++;
+        continue;
+      }
+      int gap = i;
+      while (gap <= to && skip[gap])
+        gap++;
+      if (gap > to || gap - i > merge)
+        break;
+      i = gap;
     }
-  } else {
-#endif
 
-    if ((handle = i2c_open(port.c_str(), I2C_DIRECT)) == NULL) {
-      setLastError("Cannot open i2c port %s", port.c_str());
+    if (!bus->receive(address, start, &buffer[start], end - start + 1)) {
+      bus->error(ERROR_RECEIVE, address, start, end);
+      memset(written, 0, sizeof(written));
+      health(false);
+      // readers see the failure next to the last image that was confirmed
+      if (bus->telemetry)
+        bus->telemetry->publish(address, status, timestamp(), confirmed);
       return false;
+    } 
+
+    for (int j = start; j <= end; j++) {
+      if (skip[j]) continue;
+      confirmed[j] = buffer[j];
+      if (!local[j])
+        data[j] = buffer[j];
     }
 
-#ifdef _BUILD_MPSSE
   }
-#endif
+
+  // a write only stands in for a read within its own cycle, registers outside
+  // a partial refresh may have been changed by the firmware since
+  memset(written, 0, sizeof(written));
+
+  if (full)
+    updated = true;
+
+  health(true);
+
+  sample();
+
+  if (bus->telemetry)
+    bus->telemetry->publish(address, status, sampled, confirmed);
+
+  notify();
 
   return true;
 }
 
-bool ServoBus::close() {
-  if (!handle) return false;
+/*
+  The servo is looked up again when the work runs, since it may have been
+  dropped from the bus by a rescan in the meantime.
+*/
+std::future<bool> Servo::updateAsync(bool full) {
+
+  ServoBus* owner = bus;
+  int address = getAddress();
+
+  return bus->submit([owner, address, full] {
+    std::lock_guard<BusMutex> lock(owner->mutex);
+    ServoHandler servo = owner->find(address);
+    return servo && servo->update(full);
+  });
 
-  return i2c_close((i2c_handle*) &handle) != 0;
 }
 
-int ServoBus::scan(bool force) {
+std::future<bool> Servo::seekAsync(int position, int velocity) {
 
-  if (force)
-    servos.clear();
-  else
-    cleanupServos();
+  ServoBus* owner = bus;
+  int address = getAddress();
 
-  addServos();
+  return bus->submit([owner, address, position, velocity] {
+    std::lock_guard<BusMutex> lock(owner->mutex);
+    ServoHandler servo = owner->find(address);
+    return servo && servo->seekNow(position, velocity);
+  });
 
-  return servos.size();
 }
 
-bool ServoBus::update(bool full) {
+/*
+  Write seek position and seek velocity in a single transaction, bypassing
+  the register cache flush. A negative velocity keeps the current value.
+*/
+bool Servo::seekNow(int position, int velocity) {
 
-  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+  if (!bus) return false;
 
-    if (!(*it)->update(full))
-      return false;
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  write2B(SEEK_HI, position);
+  if (velocity >= 0)
+    write2B(SEEK_VELOCITY_HI, velocity);
 
+  int address = getAddress();
+
+  if (!bus->send(address, SEEK_HI, &data[SEEK_HI], SEEK_VELOCITY_LO - SEEK_HI + 1)) {
+    bus->error(ERROR_SEND, address, SEEK_HI, SEEK_VELOCITY_LO);
+    return health(false);
   }
 
+  confirm(SEEK_HI, SEEK_VELOCITY_LO);
+
   return true;
+
 }
 
-ServoHandler ServoBus::get(int i) {
+bool Servo::curveStart() {
 
-  return servos[i];
+  std::lock_guard<BusMutex> lock(bus->mutex);
 
-}
+  if (!command(CURVE_MOTION_RESET) || !command(CURVE_MOTION_ENABLE)) {
+    bus->error(ERROR_COMMAND, getAddress(), CURVE_MOTION_ENABLE, CURVE_MOTION_ENABLE);
+    return false;
+  }
 
-int ServoBus::size() {
-  return servos.size();
-}
+  curve = true;
 
-int ServoBus::cleanupServos()
-{
-  if (!handle)
-    return -1;
+  // free slots are unknown until the next refresh
+  data[CURVE_BUFFER] = 0;
+
+  return refresh();
+
+}
+
+bool Servo::curveStop() {
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  curve = false;
+  curve_queue.clear();
+
+  if (!command(CURVE_MOTION_DISABLE)) {
+    bus->error(ERROR_COMMAND, getAddress(), CURVE_MOTION_DISABLE, CURVE_MOTION_DISABLE);
+    return false;
+  }
+
+  return true;
+
+}
+
+void Servo::curveAppend(const CurveSegment& segment) {
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  curve_queue.push_back(segment);
+
+}
+
+int Servo::curvePending() const {
+
+  return curve_queue.size();
+
+}
+
+/*
+  Move queued curve segments to the servo, as many as the last reported
+  number of free curve buffer slots allows.
+*/
+bool Servo::stream() {
+
+  if (!curve) return true;
+
+  int address = getAddress();
+
+  while (!curve_queue.empty() && data[CURVE_BUFFER] > 0) {
+
+    const CurveSegment& segment = curve_queue.front();
+
+    unsigned char* registers = &data[CURVE_DELTA_HI];
+    registers[0] = (unsigned char)(segment.delta >> 8);
+    registers[1] = (unsigned char)segment.delta;
+    registers[2] = (unsigned char)(segment.position >> 8);
+    registers[3] = (unsigned char)segment.position;
+    registers[4] = (unsigned char)(segment.in_velocity >> 8);
+    registers[5] = (unsigned char)segment.in_velocity;
+    registers[6] = (unsigned char)(segment.out_velocity >> 8);
+    registers[7] = (unsigned char)segment.out_velocity;
+
+    if (!bus->send(address, CURVE_DELTA_HI, registers, CURVE_OUT_VELOCITY_LO - CURVE_DELTA_HI + 1)) {
+      bus->error(ERROR_SEND, address, CURVE_DELTA_HI, CURVE_OUT_VELOCITY_LO);
+      return false;
+    }
+
+    confirm(CURVE_DELTA_HI, CURVE_OUT_VELOCITY_LO);
+
+    if (!command(CURVE_MOTION_APPEND)) {
+      bus->error(ERROR_COMMAND, address, CURVE_MOTION_APPEND, CURVE_MOTION_APPEND);
+      return false;
+    }
+
+    curve_queue.pop_front();
+    data[CURVE_BUFFER]--;
+
+  }
+
+  return true;
+
+}
+
+bool Servo::isSettled() {
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  int moving = (data[FLAGS_LO] >> FLAGS_LO_MOVING_STATE_0) & 0x03;
+
+  if (moving) return false;
+
+  int deadband = std::max(1, read1B(PID_DEADBAND));
+
+  return abs(read2B(POSITION_HI) - read2B(SEEK_HI)) <= deadband;
+
+}
+
+bool Servo::waitUntilSettled(int timeout) {
+
+  if (!bus) return false;
+
+  uint64_t deadline = timestamp() + timeout;
+
+  while (!isSettled()) {
+
+    uint64_t now = timestamp();
+
+    if (now >= deadline) return false;
+
+    // without a poller the status is refreshed here at a moderate rate
+    if (!bus->wait(deadline - now)) {
+      refresh();
+      usleep(std::min<uint64_t>(SETTLE_INTERVAL, deadline - now));
+    }
+
+  }
+
+  return true;
+
+}
+
+int Servo::watch(const string& name, WatchCallback callback) {
+
+  return subscribe(name, WATCH_CHANGE, 0, callback);
+
+}
+
+int Servo::watchThreshold(const string& name, int threshold, WatchCallback callback) {
+
+  return subscribe(name, WATCH_THRESHOLD, threshold, callback);
+
+}
+
+int Servo::watchFlags(int mask, WatchCallback callback) {
+
+  return subscribe("flags", WATCH_FLAGS, mask, callback);
+
+}
+
+void Servo::unwatch(int id) {
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  for (vector<Watch>::iterator it = watches.begin(); it != watches.end(); it++) {
+    if (it->id == id) {
+      // watches are only marked while notify walks them and removed after
+      if (notifying)
+        it->removed = true;
+      else
+        watches.erase(it);
+      return;
+    }
+  }
+
+  for (vector<Watch>::iterator it = added.begin(); it != added.end(); it++) {
+    if (it->id == id) {
+      added.erase(it);
+      return;
+    }
+  }
+
+}
+
+int Servo::subscribe(const string& name, int kind, int argument, WatchCallback callback) {
+
+  std::map<string, Register>::iterator reg = _registers.find(normalize(name));
+
+  if (reg == _registers.end()) return -1;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+
+  if (watches.empty())
+    memcpy(previous, confirmed, sizeof(previous));
+
+  Watch watch;
+  watch.id = ++watch_counter;
+  watch.kind = kind;
+  watch.address = reg->second.address;
+  watch.length = reg->second.length;
+  watch.argument = argument;
+  watch.removed = false;
+  watch.callback = callback;
+
+  // watches added by a callback join once notify is done with the others
+  if (notifying)
+    added.push_back(watch);
+  else
+    watches.push_back(watch);
+
+  return watch.id;
+
+}
+
+/*
+  Compare the device register image with the one from the previous refresh a
+  word at a time and invoke watches on registers in changed words.
+*/
+void Servo::notify() {
+
+  if (watches.empty()) return;
+
+  uint64_t current[SERVO_MAX_SPACE / 8];
+  memcpy(current, confirmed, sizeof(current));
+
+  unsigned int changed = 0;
+
+  for (int w = 0; w < SERVO_MAX_SPACE / 8; w++) {
+    if (current[w] != previous[w])
+      changed |= 1 << w;
+  }
+
+  if (!changed) return;
+
+  const unsigned char* before = (const unsigned char*) previous;
+  const unsigned char* after = (const unsigned char*) current;
+
+  // a notification triggered from a callback is not nested, the outer one
+  // covers the same change
+  if (notifying) return;
+
+  notifying = true;
+
+  // callbacks may watch and unwatch, both are deferred until the loop is
+  // done, so the vector is stable and callbacks are invoked in place
+  for (size_t i = 0; i < watches.size(); i++) {
+
+    const Watch& watch = watches[i];
+
+    if (watch.removed)
+      continue;
+
+    int first = watch.address / 8, last = (watch.address + watch.length - 1) / 8;
+
+    if (!(changed & ((1 << first) | (1 << last))))
+      continue;
+
+    int old_value = before[watch.address];
+    int new_value = after[watch.address];
+
+    if (watch.length == 2) {
+      old_value = (old_value << 8) | before[watch.address + 1];
+      new_value = (new_value << 8) | after[watch.address + 1];
+    }
+
+    if (old_value == new_value)
+      continue;
+
+    bool fire;
+
+    switch (watch.kind) {
+    case WATCH_THRESHOLD:
+      fire = (old_value < watch.argument) != (new_value < watch.argument);
+      break;
+    case WATCH_FLAGS:
+      fire = ((old_value ^ new_value) & watch.argument) != 0;
+      break;
+    default:
+      fire = true;
+    }
+
+    if (fire)
+      watch.callback(*this, old_value, new_value, sampled);
+
+  }
+
+  notifying = false;
+
+  watches.erase(std::remove_if(watches.begin(), watches.end(),
+    [](const Watch& watch) { return watch.removed; }), watches.end());
+
+  if (!added.empty()) {
+    std::move(added.begin(), added.end(), std::back_inserter(watches));
+    added.clear();
+  }
+
+  memcpy(previous, current, sizeof(previous));
+
+}
+
+bool Servo::record(int capacity, const vector<string>& registers) {
+
+  std::unique_lock<BusMutex> lock;
+
+  if (bus) lock = std::unique_lock<BusMutex>(bus->mutex);
+
+  if (capacity < 1) {
+    recorder.store(NULL, std::memory_order_release);
+    return true;
+  }
+
+  if (registers.size() > HISTORY_CHANNELS) return false;
+
+  std::unique_ptr<History> buffer(new History(capacity));
+
+  buffer->channels = registers.size();
+
+  for (size_t i = 0; i < registers.size(); i++) {
+    std::map<string, Register>::iterator reg = _registers.find(normalize(registers[i]));
+    if (reg == _registers.end()) return false;
+    buffer->address[i] = reg->second.address;
+    buffer->length[i] = reg->second.length;
+  }
+
+  recorder.store(buffer.get(), std::memory_order_release);
+  rings.push_back(std::move(buffer));
+
+  return true;
+
+}
+
+/*
+  Append the current register image to the history ring. Each slot carries a
+  sequence number that is odd while it is being written.
+*/
+void Servo::sample() {
+
+  History* buffer = recorder.load(std::memory_order_acquire);
+
+  if (!buffer) return;
+
+  uint64_t index = buffer->head.load(std::memory_order_relaxed);
+  History::Slot& slot = buffer->slots[index % buffer->capacity];
+
+  slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.sample.timestamp = sampled;
+  slot.sample.timer = (confirmed[TIMER_HI] << 8) | confirmed[TIMER_LO];
+
+  for (int c = 0; c < buffer->channels; c++) {
+    int address = buffer->address[c];
+    slot.sample.values[c] = buffer->length[c] == 2 ?
+      (confirmed[address] << 8) | confirmed[address + 1] : confirmed[address];
+  }
+
+  slot.sequence.store(2 * index + 2, std::memory_order_release);
+  buffer->head.store(index + 1, std::memory_order_release);
+
+}
+
+/*
+  Visit the samples of the history ring. A slot is copied to the stack and
+  validated against its sequence number before it is handed out, slots
+  overwritten meanwhile are skipped rather than waited for.
+*/
+int Servo::history(const SampleVisitor& visitor, uint64_t since) const {
+
+  const History* buffer = recorder.load(std::memory_order_acquire);
+
+  if (!buffer) return 0;
+
+  int visited = 0;
+
+  uint64_t head = buffer->head.load(std::memory_order_acquire);
+  uint64_t first = head > (uint64_t) buffer->capacity ? head - buffer->capacity : 0;
+
+  for (uint64_t index = first; index < head; index++) {
+
+    const History::Slot& slot = buffer->slots[index % buffer->capacity];
+
+    if (slot.sequence.load(std::memory_order_acquire) != 2 * index + 2)
+      continue;
+
+    Sample copy = slot.sample;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (slot.sequence.load(std::memory_order_relaxed) != 2 * index + 2)
+      continue;
+
+    if (copy.timestamp > since) {
+      visitor(copy);
+      visited++;
+    }
+
+  }
+
+  return visited;
+
+}
+
+int Servo::history(vector<Sample>& samples, uint64_t since) const {
+
+  samples.clear();
+
+  return history([&samples](const Sample& sample) { samples.push_back(sample); }, since);
+
+}
+
+/*
+  End a write session whose timeout has elapsed.
+*/
+bool Servo::expire() {
+
+  if (session && session_expires && timestamp() >= session_expires)
+    return endSession();
+
+  return true;
+
+}
+
+bool Servo::isResponsive() const {
+
+  return responsive;
+
+}
+
+int Servo::getFailures() const {
+
+  return failures;
+
+}
+
+UpdateStatus Servo::getStatus() const {
+
+  return status;
+
+}
+
+uint64_t Servo::getLastSample() const {
+
+  return sampled;
+
+}
+
+unsigned long Servo::getCorruptions() const {
+
+  if (!bus) return 0;
+
+  return bus->getCorruptions(read1B(TWI_ADDRESS));
+
+}
+
+/*
+  Record the outcome of a bus transaction sequence, a servo that fails too
+  many times in a row is moved to quarantine.
+*/
+bool Servo::health(bool success) {
+
+  if (success) {
+    failures = 0;
+    status = UPDATE_OK;
+    sampled = timestamp();
+    return true;
+  }
+
+  status = update_status(bus->result);
+
+  // Running out of cycle time is not the fault of the servo
+  if (status == UPDATE_ABORTED)
+    return false;
+
+  failures++;
+
+  if (bus->quarantine_threshold > 0 && failures >= bus->quarantine_threshold)
+    responsive = false;
+
+  return false;
+
+}
+
+/*
+  Cheap single byte read used to check if a quarantined servo came back. On
+  success the servo rejoins the bus and its register image is refreshed.
+*/
+bool Servo::probe() {
+
+  if (!bus) return false;
+
+  unsigned char type;
+
+  if (!bus->receive(getAddress(), DEVICE_TYPE, &type, 1))
+    return false;
+
+  responsive = true;
+  failures = 0;
+
+  return update(true);
+
+}
+
+
+/*
+  Store an error record in the ring of recent errors. Only plain values are
+  copied so this is cheap enough to call from the update path, the record is
+  turned into a message only when somebody asks for it.
+*/
+void ServoBus::error(ErrorCode code, int address, int from, int to) {
+
+  uint32_t index = errors_head.fetch_add(1, std::memory_order_relaxed);
+  ErrorSlot& slot = errors[index % ERROR_HISTORY];
+
+  slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.record.code = code;
+  slot.record.status = update_status(result);
+  slot.record.address = address;
+  slot.record.from = from;
+  slot.record.to = to;
+  slot.record.error = handle ? i2c_get_error((i2c_handle)handle) : errno;
+  slot.record.timestamp = timestamp();
+
+  slot.sequence.store(2 * index + 2, std::memory_order_release);
+
+}
+
+/*
+  Copy the retained error records, oldest first. Records that are being
+  overwritten while copying are skipped.
+*/
+uint32_t ServoBus::getErrors(vector<ErrorRecord>& records, uint32_t since) const {
+
+  uint32_t head = errors_head.load(std::memory_order_acquire);
+  uint32_t first = head > ERROR_HISTORY ? head - ERROR_HISTORY : 0;
+
+  if (since > first) first = since;
+
+  records.clear();
+
+  for (uint32_t index = first; index < head; index++) {
+
+    const ErrorSlot& slot = errors[index % ERROR_HISTORY];
+
+    if (slot.sequence.load(std::memory_order_acquire) != 2 * index + 2)
+      continue;
+
+    ErrorRecord record = slot.record;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (slot.sequence.load(std::memory_order_relaxed) != 2 * index + 2)
+      continue;
+
+    records.push_back(record);
+
+  }
+
+  return head;
+
+}
+
+WriteSession::WriteSession(ServoHandler servo, int timeout): servo(servo) {
+
+  if (!servo || !servo->beginSession(timeout))
+    this->servo.reset();
+
+}
+
+WriteSession::~WriteSession() {
+
+  close();
+
+}
+
+bool WriteSession::isActive() const {
+
+  return servo && servo->session;
+
+}
+
+bool WriteSession::close() {
+
+  if (!servo) return false;
+
+  bool success = servo->endSession();
+
+  servo.reset();
+
+  return success;
+
+}
+
+ServoGroup::ServoGroup(): bus(NULL), window(0) {
+
+}
+
+ServoGroup::ServoGroup(const vector<ServoHandler>& servos): bus(NULL), window(0) {
+
+  for (vector<ServoHandler>::const_iterator it = servos.begin(); it != servos.end(); it++)
+    add(*it);
+
+}
+
+ServoGroup::~ServoGroup() {
+
+}
+
+bool ServoGroup::add(ServoHandler servo) {
+
+  if (!servo || !servo->bus) return false;
+
+  // all servos of a group have to share a bus
+  if (bus && servo->bus != bus) return false;
+
+  bus = servo->bus;
+  servos.push_back(servo);
+
+  return true;
+
+}
+
+void ServoGroup::clear() {
+
+  servos.clear();
+  bus = NULL;
+
+}
+
+int ServoGroup::size() const {
+
+  return servos.size();
+
+}
+
+ServoHandler ServoGroup::get(int i) const {
+
+  return servos[i];
+
+}
+
+bool ServoGroup::commit() {
+
+  if (!bus) return false;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+  ServoBus::Arbitration arbitration(bus, LOCKING_CYCLE);
+
+  uint64_t start = timestamp();
+
+  // a commit that is part of an update shares the cycle budget with the reads
+  bool standalone = bus->cycle_start == 0;
+  if (standalone)
+    bus->cycle_start = start;
+
+  bool success = bus->flushTargets(servos);
+
+  window = timestamp() - start;
+
+  if (standalone)
+    bus->cycle_start = 0;
+
+  return success;
+
+}
+
+bool ServoGroup::update(bool full) {
+
+  if (!bus) return false;
+
+  std::lock_guard<BusMutex> lock(bus->mutex);
+  ServoBus::Arbitration arbitration(bus, LOCKING_CYCLE);
+
+  bus->cycle_start = timestamp();
+
+  bool success = commit();
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+
+    if (!(*it)->responsive)
+      continue;
+
+    if (!(*it)->refresh(full))
+      success = false;
+
+  }
+
+  bus->cycle_start = 0;
+
+  return success;
+
+}
+
+uint64_t ServoGroup::getWriteWindow() const {
+
+  return window;
+
+}
+
+bool ServoGroup::waitUntilSettled(int timeout) {
+
+  if (!bus) return false;
+
+  uint64_t deadline = timestamp() + timeout;
+
+  while (true) {
+
+    bool settled = true;
+
+    for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end() && settled; it++)
+      settled = (*it)->isSettled();
+
+    if (settled) return true;
+
+    uint64_t now = timestamp();
+
+    if (now >= deadline) return false;
+
+    if (!bus->wait(deadline - now)) {
+
+      {
+        std::lock_guard<BusMutex> lock(bus->mutex);
+        for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+          if ((*it)->responsive)
+            (*it)->refresh();
+        }
+      }
+
+      usleep(std::min<uint64_t>(SETTLE_INTERVAL, deadline - now));
+
+    }
+
+  }
+
+}
+
+string ServoBus::describe(const ErrorRecord& record) const {
+
+  char buffer[128];
+
+  switch (record.code) {
+  case ERROR_OPEN:
+    snprintf(buffer, sizeof(buffer), "Cannot open i2c port %s", port.empty() ? "MPSSE" : port.c_str());
+    break;
+  case ERROR_WRITE_ENABLE:
+    snprintf(buffer, sizeof(buffer), "Unable to enable write access to address %d", record.address);
+    break;
+  case ERROR_WRITE_DISABLE:
+    snprintf(buffer, sizeof(buffer), "Unable to disable write access to address %d", record.address);
+    break;
+  case ERROR_SEND:
+    snprintf(buffer, sizeof(buffer), "Unable to send registers %d to %d to address %d.", record.from, record.to, record.address);
+    break;
+  case ERROR_RECEIVE:
+    snprintf(buffer, sizeof(buffer), "Unable to read registers %d to %d from address %d.", record.from, record.to, record.address);
+    break;
+  case ERROR_COMMAND:
+    snprintf(buffer, sizeof(buffer), "Unable to send command %d to address %d.", record.from, record.address);
+    break;
+  case ERROR_OVERLOAD:
+    snprintf(buffer, sizeof(buffer), "Predicted update duration exceeds the polling period.");
+    break;
+  case ERROR_DEADLINE:
+    snprintf(buffer, sizeof(buffer), "Scheduled operation %d of priority %d missed its deadline at address %d.", record.from, record.to, record.address);
+    break;
+  case ERROR_LOCK:
+    snprintf(buffer, sizeof(buffer), "Timed out waiting for the bus lock held by another process.");
+    break;
+  case ERROR_QUARANTINED:
+    snprintf(buffer, sizeof(buffer), "Scheduled operation %d of priority %d held back for quarantined address %d.", record.from, record.to, record.address);
+    break;
+  default:
+    return string();
+  }
+
+  string message(buffer);
+
+  if (record.error)
+    message += string(" (") + strerror(record.error) + ")";
+
+  return message;
+
+}
+
+string ServoBus::getLastError() {
+
+  vector<ErrorRecord> records;
+
+  errors_read = getErrors(records, errors_read);
+
+  if (records.empty()) return string();
+
+  return describe(records.back());
+
+}
+
+ServoBus::ServoBus() {
+
+  if (__is_debug_enabled())
+    __debug_enable();
+
+  handle = NULL;
+  result = I2C_OK;
+
+  errors_head = 0;
+  errors_read = 0;
+  for (int i = 0; i < ERROR_HISTORY; i++)
+    errors[i].sequence = 0;
+
+  cycle_start = 0;
+
+  checked = false;
+  checked_retries = 2;
+  batching = true;
+  elision = false;
+  general_call = false;
+  memset(corrupted, 0, sizeof(corrupted));
+
+  quarantine_threshold = 3;
+  quarantine_interval = 100;
+  cycle = 0;
+
+  scheduler.reset(new Scheduler());
+
+  realtime = false;
+  executing = false;
+  completion = -1;
+
+  locking = LOCKING_TRANSACTION;
+  lock_depth = 0;
+  memset(&lock_stats, 0, sizeof(lock_stats));
+
+  polling = false;
+  poll_period = 0;
+  poll_full = false;
+  poll_cycles = 0;
+
+}
+
+ServoBus::~ServoBus() {
+
+  halt();
+
+  if (completion >= 0)
+    ::close(completion);
+
+  close();
+
+}
+
+
+/*
+  Open the transport named by a port string. Besides i2c-dev device paths
+  and MPSSE adapters this understands "record:<trace>:<port>", which records
+  all traffic on the inner port to a trace file, and "replay:<trace>[:<speed>]",
+  which serves a recorded trace instead of a bus. Speed scales the recorded
+  transaction durations, 0 replays without any delay.
+*/
+static i2c_handle open_port(const string& port) {
+
+  if (port.compare(0, 7, "record:") == 0) {
+    size_t split = port.find(':', 7);
+    if (split == string::npos) return NULL;
+    return i2c_record(port.substr(7, split - 7).c_str(), open_port(port.substr(split + 1)));
+  }
+
+  if (port.compare(0, 7, "replay:") == 0) {
+    string trace = port.substr(7);
+    double speed = 1;
+    size_t split = trace.rfind(':');
+    if (split != string::npos) {
+      char* end;
+      double value = strtod(trace.c_str() + split + 1, &end);
+      if (*end == 0 && end != trace.c_str() + split + 1) {
+        speed = value;
+        trace.resize(split);
+      }
+    }
+    return i2c_replay(trace.c_str(), speed);
+  }
+
+#ifdef _BUILD_MPSSE
+  // "mpsse:<interface>[:<index>]" selects a channel of a multi channel
+  // adapter, an empty port the first channel of the first adapter
+  if (port.empty() || port.compare(0, 5, "mpsse") == 0) {
+    string location = port.size() > 6 ? port.substr(6) : string();
+    return i2c_open(location.c_str(), I2C_MPSSE);
+  }
+#endif
+
+  return i2c_open(port.c_str(), I2C_DIRECT);
+}
+
+bool ServoBus::open(const string& port) {
+
+  if (handle) close();
+
+  this->port = port;
+
+  if ((handle = open_port(port)) == NULL) {
+    error(ERROR_OPEN);
+    return false;
+  }
+
+  if (policy.deadline > 0)
+    i2c_timeout((i2c_handle)handle, policy.deadline);
+
+  return true;
+}
+
+bool ServoBus::close() {
+
+  // the background threads must not touch the handle once it is freed
+  halt();
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  if (!handle) return false;
+
+  return i2c_close((i2c_handle*) &handle) != 0;
+}
+
+int ServoBus::scan(bool force) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_TRANSACTION);
+
+  if (force)
+    servos.clear();
+  else
+    cleanupServos();
+
+  addServos();
+
+  reserve();
+
+  return servos.size();
+}
+
+/*
+  Size the buffers used during a cycle for the current set of servos, so
+  that steady state updates do not allocate.
+*/
+void ServoBus::reserve() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  size_t count = servos.size();
+
+  poll_status.resize(count);
+  batch_messages.reserve(count * (SERVO_MAX_SPACE / 2 + 2));
+  batch_buffer.reserve(count * SERVO_MAX_SPACE * 2);
+  batch_servos.reserve(count);
+  scheduler->queue.reserve(count * SCHEDULE_OPERATIONS);
+  scheduler->running.reserve(count * SCHEDULE_OPERATIONS);
+  scheduler->deferred.reserve(count * SCHEDULE_OPERATIONS);
+
+}
+
+bool ServoBus::update(bool full) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  cycle++;
+  cycle_start = timestamp();
+
+  bool success = true;
+
+  // a failing servo does not cost the servos after it their cycle, the
+  // outcome of each servo is kept in its status
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+
+    if (!(*it)->responsive) {
+      recover(it->get());
+      continue;
+    }
+
+    if (!(*it)->update(full))
+      success = false;
+
+  }
+
+  cycle_start = 0;
+
+  return success;
+}
+
+int ServoBus::update(vector<UpdateStatus>& status, bool full) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  cycle++;
+  cycle_start = timestamp();
+
+  int succeeded = 0;
+
+  status.resize(servos.size());
+
+  for (size_t i = 0; i < servos.size(); i++) {
+
+    Servo* servo = servos[i].get();
+
+    if (!servo->responsive) {
+      if (recover(servo)) {
+        status[i] = UPDATE_OK;
+        succeeded++;
+      } else {
+        status[i] = UPDATE_QUARANTINED;
+      }
+      continue;
+    }
+
+    if (servo->update(full))
+      succeeded++;
+
+    status[i] = servo->status;
+
+  }
+
+  cycle_start = 0;
+
+  return succeeded;
+}
+
+/*
+  Probe a quarantined servo every quarantine interval bus cycles, every
+  kind of cycle counts. Returns true if the servo answered and is back.
+*/
+bool ServoBus::recover(Servo* servo) {
+
+  if (quarantine_interval <= 0 || (cycle % quarantine_interval) != 0)
+    return false;
+
+  return servo->probe();
+
+}
+
+/*
+  Write pending registers of all responsive servos. When possible all writes
+  are combined into a single bus transfer, otherwise servos are flushed one
+  after another.
+*/
+bool ServoBus::flush() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  cycle++;
+  cycle_start = timestamp();
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+    if (!(*it)->responsive)
+      recover(it->get());
+  }
+
+  bool success = flushTargets(servos);
+
+  cycle_start = 0;
+
+  return success;
+
+}
+
+/*
+  Write pending registers of the responsive servos among targets, combined
+  into a single transfer when possible and one servo after another
+  otherwise. Shared by bus flushes and group commits.
+*/
+bool ServoBus::flushTargets(const vector<ServoHandler>& targets) {
+
+  bool success = true;
+
+  if (batching && !checked && flushBatch(targets, success))
+    return success;
+
+  for (vector<ServoHandler>::const_iterator it = targets.begin(); it != targets.end(); it++) {
+
+    if (!(*it)->responsive)
+      continue;
+
+    if (!(*it)->flush())
+      success = false;
+
+  }
+
+  return success;
+
+}
+
+/*
+  Read status registers of all responsive servos.
+*/
+bool ServoBus::refresh(bool full) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  cycle++;
+  cycle_start = timestamp();
+
+  bool success = true;
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+
+    if (!(*it)->responsive) {
+      recover(it->get());
+      continue;
+    }
+
+    if (!(*it)->refresh(full))
+      success = false;
+
+  }
+
+  cycle_start = 0;
+
+  return success;
+
+}
+
+bool ServoBus::enableAll() {
+
+  return broadcast(PWM_ENABLE);
+
+}
+
+bool ServoBus::disableAll() {
+
+  return broadcast(PWM_DISABLE);
+
+}
+
+bool ServoBus::resetAll() {
+
+  return broadcast(RESET);
+
+}
+
+void ServoBus::setGeneralCall(bool enabled) {
+
+  general_call = enabled;
+
+}
+
+/*
+  Send a command to every servo on the bus, including quarantined ones. Falls
+  back from a general call to a combined transfer and finally to sending the
+  command to servos one by one. Responsive servos come first, so a dead servo
+  that stops the combined transfer does not keep the command from the others.
+  The combined transfer is tried once and only where the transport reports how
+  far it got, the fallback then sends to the servos it did not reach, so a
+  command like RESET is never delivered twice.
+*/
+bool ServoBus::broadcast(unsigned char cmd) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  if (!handle) return false;
+
+  unsigned char command = cmd | 0x80;
+
+  if (general_call) {
+
+    i2c_message message = {GENERAL_CALL_ADDRESS, 0, &command, 1};
+
+    if (batch(&message, 1))
+      return true;
+
+  }
+
+  batch_servos.clear();
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++)
+    if ((*it)->isResponsive())
+      batch_servos.push_back(it->get());
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++)
+    if (!(*it)->isResponsive())
+      batch_servos.push_back(it->get());
+
+  size_t reached = 0;
+
+  if (batching && !batch_servos.empty() && i2c_transferred((i2c_handle) handle) >= 0) {
+
+    batch_messages.clear();
+
+    for (vector<Servo*>::iterator it = batch_servos.begin(); it != batch_servos.end(); it++)
+      batch_messages.push_back(i2c_message{(*it)->getAddress(), 0, &command, 1});
+
+    {
+      Arbitration transaction(this, LOCKING_TRANSACTION);
+      result = i2c_transfer((i2c_handle) handle, batch_messages.data(), batch_messages.size());
+    }
+
+    if (result == I2C_OK)
+      return true;
+
+    if (result == I2C_ERROR_UNSUPPORTED)
+      batching = false;
+    else
+      reached = std::max(i2c_transferred((i2c_handle) handle), 0);
+
+  }
+
+  bool success = true;
+
+  for (size_t i = reached; i < batch_servos.size(); i++) {
+
+    if (!batch_servos[i]->command(cmd)) {
+      error(ERROR_COMMAND, batch_servos[i]->getAddress(), cmd, cmd);
+      success = false;
+    }
+
+  }
+
+  return success;
+
+}
+
+/*
+  Pack pending writes of the given servos (including the write enable bracket
+  of unlocked servos) into one combined transfer. Returns false if the
+  transfer failed, in which case nothing is marked as written and the caller
+  flushes the servos one by one. Once the transfer went through, failures of
+  individual servos are recorded in their health and reported in success
+  only, so that no servo is flushed (and counted) twice in a cycle.
+*/
+bool ServoBus::flushBatch(const vector<ServoHandler>& targets, bool& success) {
+
+  batch_messages.clear();
+  batch_servos.clear();
+  batch_buffer.resize(targets.size() * SERVO_MAX_SPACE * 2);
+
+  unsigned char* cursor = batch_buffer.data();
+
+  for (vector<ServoHandler>::const_iterator it = targets.begin(); it != targets.end(); it++) {
+
+    Servo* servo = it->get();
+
+    if (!servo->responsive)
+      continue;
+
+    int address = servo->getAddress();
+    bool bracket = !servo->locked && !servo->session;
+    size_t first = batch_messages.size();
+    unsigned char* begin = cursor;
+
+    if (bracket) {
+      cursor[0] = WRITE_ENABLE;
+      batch_messages.push_back(i2c_message{address, 0, cursor, 1});
+      cursor++;
+    }
+
+    bool pending = false;
+
+    for (int i = 0; i < SERVO_MAX_SPACE; i++) {
+
+      int start = i;
+
+      while (i < SERVO_MAX_SPACE && servo->local[i])
+        i++;
+
+      if (start == i) continue;
+
+      cursor[0] = start & 0x7F;
+      memcpy(&cursor[1], &servo->data[start], i - start);
+      batch_messages.push_back(i2c_message{address, 0, cursor, i - start + 1});
+      cursor += i - start + 1;
+      pending = true;
+
+    }
+
+    if (!pending) {
+      batch_messages.resize(first);
+      cursor = begin;
+      continue;
+    }
+
+    if (bracket) {
+      cursor[0] = WRITE_DISABLE;
+      batch_messages.push_back(i2c_message{address, 0, cursor, 1});
+      cursor++;
+    }
+
+    batch_servos.push_back(servo);
+
+  }
+
+  if (!batch_messages.empty() && !batch(batch_messages.data(), batch_messages.size())) {
+    if (result == I2C_ERROR_UNSUPPORTED)
+      batching = false;
+    return false;
+  }
+
+  for (vector<Servo*>::iterator it = batch_servos.begin(); it != batch_servos.end(); it++) {
+
+    Servo* servo = *it;
+
+    for (int i = 0; i < SERVO_MAX_SPACE; i++) {
+      if (servo->local[i])
+        servo->confirm(i, i);
+    }
+
+    if (!servo->locked && !servo->session)
+      servo->locked = true;
+
+  }
+
+  // sessions time out and curve segments are streamed on every flush, also
+  // when no register was dirty
+  for (vector<ServoHandler>::const_iterator it = targets.begin(); it != targets.end(); it++) {
+
+    Servo* servo = it->get();
+
+    if (!servo->responsive)
+      continue;
+
+    if (!servo->expire()) {
+      error(ERROR_WRITE_DISABLE, servo->getAddress());
+      success = servo->health(false);
+    } else if (!servo->stream()) {
+      success = servo->health(false);
+    }
+
+  }
+
+  return true;
+
+}
+
+void ServoBus::setQuarantine(int threshold, int interval) {
+
+  quarantine_threshold = threshold;
+  quarantine_interval = interval;
+
+  if (threshold > 0) return;
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+    (*it)->responsive = true;
+  }
+
+}
+
+void ServoBus::setPolicy(const BusPolicy& p) {
+
+  policy = p;
+
+  if (handle && policy.deadline > 0)
+    i2c_timeout((i2c_handle)handle, policy.deadline);
+
+}
+
+BusPolicy ServoBus::getPolicy() const {
+
+  return policy;
+
+}
+
+/*
+  Decide if a transaction may be (re)attempted. Checks the cycle budget, the
+  number of retries for the transaction class and the transaction deadline and
+  sleeps for the backoff delay before a retry.
+*/
+bool ServoBus::retry(TransactionClass type, uint64_t started, int attempt) {
+
+  uint64_t now = timestamp();
+
+  if (policy.budget > 0 && cycle_start && now - cycle_start >= (uint64_t) policy.budget) {
+    result = BUS_BUDGET_EXCEEDED;
+    return false;
+  }
+
+  if (attempt == 0) return true;
+
+  if (attempt > policy.retries[type]) return false;
+
+  int delay = policy.backoff;
+  for (int i = 1; i < attempt && delay < policy.backoff_limit; i++)
+    delay *= 2;
+  if (delay > policy.backoff_limit)
+    delay = policy.backoff_limit;
+
+  if (policy.deadline > 0 && now + delay - started >= (uint64_t) policy.deadline)
+    return false;
+
+  if (delay > 0)
+    usleep(delay);
+
+  return true;
+
+}
+
+bool ServoBus::schedule(ServoHandler servo, ScheduledOperation operation, uint64_t deadline) {
+
+  static const Priority defaults[SCHEDULE_OPERATIONS] = {PRIORITY_SAFETY, PRIORITY_SAFETY,
+    PRIORITY_SAFETY, PRIORITY_SETPOINT, PRIORITY_CONFIG, PRIORITY_FAST, PRIORITY_SLOW};
+
+  if (operation >= SCHEDULE_OPERATIONS) return false;
+
+  return schedule(servo, operation, defaults[operation], deadline);
+
+}
+
+bool ServoBus::schedule(ServoHandler servo, ScheduledOperation operation, Priority priority, uint64_t deadline) {
+
+  if (!servo || servo->bus != this || operation >= SCHEDULE_OPERATIONS || priority >= PRIORITY_CLASSES)
+    return false;
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  for (vector<Scheduler::Job>::iterator it = scheduler->queue.begin(); it != scheduler->queue.end(); it++) {
+
+    if (it->servo != servo || it->operation != operation)
+      continue;
+
+    it->priority = std::min(it->priority, priority);
+    if (deadline && (!it->deadline || deadline < it->deadline))
+      it->deadline = deadline;
+
+    return true;
+
+  }
+
+  Scheduler::Job job = {servo, operation, priority, deadline, scheduler->sequence++, false};
+  scheduler->queue.push_back(job);
+
+  return true;
+
+}
+
+void ServoBus::scheduleCycle(bool full, uint64_t deadline) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+
+    Servo* servo = it->get();
+
+    if (!servo->responsive)
+      continue;
+
+    bool seek = false, other = false;
+
+    for (int i = 0; i < SERVO_MAX_SPACE; i++) {
+      if (!servo->local[i]) continue;
+      if (i >= SEEK_HI && i <= SEEK_VELOCITY_LO)
+        seek = true;
+      else
+        other = true;
+    }
+
+    if (seek)
+      schedule(*it, SCHEDULE_SEEK, deadline);
+
+    if (other || !servo->curve_queue.empty())
+      schedule(*it, SCHEDULE_FLUSH, deadline);
+
+    schedule(*it, full ? SCHEDULE_FULL : SCHEDULE_STATUS, deadline);
+
+  }
+
+}
+
+/*
+  Execute queued transactions, most urgent first. Work whose estimated
+  duration no longer fits into the cycle budget is deferred to the next call,
+  low priority work that is already past its deadline is dropped. Safety
+  transactions ignore the budget and setpoints are written even when late.
+  Other work for quarantined servos stays queued until the servo recovers,
+  which is probed for on the quarantine interval like in any other cycle.
+*/
+int ServoBus::execute() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  // jobs are taken out of the queue, so that callbacks of the executed
+  // operations can schedule new ones while the queue is processed
+  vector<Scheduler::Job>& queue = scheduler->queue;
+  vector<Scheduler::Job>& running = scheduler->running;
+  SchedulerStatistics& statistics = scheduler->statistics;
+
+  running.clear();
+  running.swap(queue);
+
+  std::stable_sort(running.begin(), running.end(), Scheduler::order);
+
+  // an execution is a bus cycle, quarantined servos are probed on the
+  // quarantine interval so that their held jobs can run once they answer
+  cycle++;
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+    if (!(*it)->responsive)
+      recover(it->get());
+  }
+
+  uint64_t start = timestamp();
+  int executed = 0;
+
+  vector<Scheduler::Job>& deferred = scheduler->deferred;
+  deferred.clear();
+
+  for (size_t i = 0; i < running.size(); i++) {
+
+    Scheduler::Job& job = running[i];
+    Servo* servo = job.servo.get();
+    uint64_t now = timestamp();
+
+    // safety operations are attempted even on quarantined servos, anything
+    // else waits until the servo answers a probe again
+    if (!servo->responsive && job.priority != PRIORITY_SAFETY) {
+      if (!job.held) {
+        job.held = true;
+        statistics.held[job.priority]++;
+        error(ERROR_QUARANTINED, servo->getAddress(), job.operation, job.priority);
+      }
+      deferred.push_back(job);
+      continue;
+    }
+
+    if (job.deadline && now > job.deadline && job.priority > PRIORITY_SETPOINT) {
+      statistics.dropped[job.priority]++;
+      statistics.missed[job.priority]++;
+      result = BUS_BUDGET_EXCEEDED;
+      error(ERROR_DEADLINE, servo->getAddress(), job.operation, job.priority);
+      continue;
+    }
+
+    if (policy.budget > 0 && job.priority != PRIORITY_SAFETY &&
+        now - start + scheduler->estimate[job.operation] > (uint64_t) policy.budget) {
+      statistics.deferred[job.priority]++;
+      deferred.push_back(job);
+      continue;
+    }
+
+    // safety transactions are never cut short by the budget check of retry
+    cycle_start = job.priority == PRIORITY_SAFETY ? 0 : start;
+
+    switch (job.operation) {
+    case SCHEDULE_DISABLE:
+      servo->disable();
+      break;
+    case SCHEDULE_ENABLE:
+      servo->enable();
+      break;
+    case SCHEDULE_RESET:
+      servo->reset();
+      break;
+    case SCHEDULE_SEEK:
+      servo->seekNow(servo->read2B(SEEK_HI), servo->read2B(SEEK_VELOCITY_HI));
+      break;
+    case SCHEDULE_FLUSH:
+      servo->flush();
+      break;
+    case SCHEDULE_STATUS:
+    case SCHEDULE_FULL:
+      servo->refresh(job.operation == SCHEDULE_FULL);
+      break;
+    }
+
+    uint64_t finished = timestamp();
+    uint64_t& estimate = scheduler->estimate[job.operation];
+
+    estimate = estimate ? (estimate * 7 + (finished - now)) / 8 : finished - now;
+
+    statistics.executed[job.priority]++;
+    executed++;
+
+    if (job.deadline && finished > job.deadline) {
+      statistics.missed[job.priority]++;
+      error(ERROR_DEADLINE, servo->getAddress(), job.operation, job.priority);
+    }
+
+  }
+
+  cycle_start = 0;
+
+  // keep jobs scheduled during execution behind the deferred ones
+  deferred.insert(deferred.end(), queue.begin(), queue.end());
+  queue.swap(deferred);
+  running.clear();
+
+  return executed;
+
+}
+
+int ServoBus::getScheduled() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  return scheduler->queue.size();
+
+}
+
+SchedulerStatistics ServoBus::getSchedulerStatistics() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  return scheduler->statistics;
+
+}
+
+/*
+  Median duration of a transaction in microseconds over samples attempts,
+  negative if any attempt fails.
+*/
+static double measure(std::function<bool()> transaction, int samples) {
+
+  vector<uint64_t> durations;
+
+  for (int i = 0; i < samples; i++) {
+
+    uint64_t start = timestamp();
+
+    if (!transaction())
+      return -1;
+
+    durations.push_back(timestamp() - start);
+
+  }
+
+  std::sort(durations.begin(), durations.end());
+
+  return durations[durations.size() / 2];
+
+}
+
+// Least squares line through the measured (size, duration) points
+static void fit(const int* sizes, const double* durations, int count, double& overhead, double& per_byte) {
+
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+  for (int i = 0; i < count; i++) {
+    sx += sizes[i];
+    sy += durations[i];
+    sxx += sizes[i] * sizes[i];
+    sxy += sizes[i] * durations[i];
+  }
+
+  double d = count * sxx - sx * sx;
+
+  per_byte = d > 0 ? (count * sxy - sx * sy) / d : 0;
+
+  if (per_byte < 0)
+    per_byte = 0;
+
+  overhead = std::max(0.0, (sy - per_byte * sx) / count);
+
+}
+
+bool ServoBus::calibrate(int samples) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+  Arbitration arbitration(this, LOCKING_CYCLE);
+
+  if (!handle || samples < 1) return false;
+
+  Servo* servo = NULL;
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+    if ((*it)->responsive) {
+      servo = it->get();
+      break;
+    }
+  }
+
+  // timing writes is only free of side effects while the servo discards them
+  if (!servo || !servo->locked) return false;
+
+  unsigned char address = servo->getAddress();
+  unsigned char buffer[SERVO_MAX_SPACE];
+  static const int sizes[CALIBRATION_SIZES] = {1, 2, 4, 8, 16};
+  double reads[CALIBRATION_SIZES], writes[CALIBRATION_SIZES];
+
+  cycle_start = 0;
+
+  for (int i = 0; i < CALIBRATION_SIZES; i++) {
+    int size = sizes[i];
+    reads[i] = measure([&]() { return receive(address, DEVICE_TYPE, buffer, size); }, samples);
+    if (reads[i] < 0) return false;
+  }
+
+  memset(buffer, 0, sizeof(buffer));
+
+  for (int i = 0; i < CALIBRATION_SIZES; i++) {
+    int size = sizes[i];
+    writes[i] = measure([&]() { return send(address, CALIBRATION_SCRATCH, buffer, size); }, samples);
+    if (writes[i] < 0) return false;
+  }
+
+  CostModel fitted;
+
+  fit(sizes, reads, CALIBRATION_SIZES, fitted.overhead[TRANSACTION_READ], fitted.per_byte[TRANSACTION_READ]);
+  fit(sizes, writes, CALIBRATION_SIZES, fitted.overhead[TRANSACTION_WRITE], fitted.per_byte[TRANSACTION_WRITE]);
+
+  // a command is a write of the command byte only, repeating write disable
+  // leaves the servo unchanged
+  double command = measure([&]() { return send(address, WRITE_DISABLE, NULL, 0); }, samples);
+
+  if (command < 0) return false;
+
+  fitted.overhead[TRANSACTION_COMMAND] = command;
+  fitted.per_byte[TRANSACTION_COMMAND] = 0;
+  fitted.calibrated = true;
+
+  model = fitted;
+
+  DEBUGMSG("Calibrated read %.1f + %.2f/B, write %.1f + %.2f/B, command %.1f us\n",
+    model.overhead[TRANSACTION_READ], model.per_byte[TRANSACTION_READ],
+    model.overhead[TRANSACTION_WRITE], model.per_byte[TRANSACTION_WRITE],
+    model.overhead[TRANSACTION_COMMAND]);
+
+  return true;
+
+}
+
+CostModel ServoBus::getCostModel() const {
+
+  return model;
+
+}
+
+void ServoBus::setCostModel(const CostModel& m) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  model = m;
+
+}
+
+double ServoBus::cost(TransactionClass type, int bytes) const {
+
+  return model.overhead[type] + model.per_byte[type] * bytes;
+
+}
+
+/*
+  Predicted duration of an update of a single servo: pending write ranges
+  (with the write enable bracket if needed) followed by the status read.
+*/
+uint64_t ServoBus::predict(Servo* servo, bool full) const {
+
+  double total = 0;
+  bool pending = false;
+
+  for (int i = 0; i < SERVO_MAX_SPACE; i++) {
+
+    if (!servo->local[i]) continue;
+
+    int start = i;
+    while (i < SERVO_MAX_SPACE && servo->local[i])
+      i++;
+
+    total += cost(TRANSACTION_WRITE, i - start);
+    pending = true;
+
+  }
+
+  if (pending && !servo->locked && !servo->session)
+    total += 2 * cost(TRANSACTION_COMMAND, 0);
+
+  int from = full ? 0 : FLAGS_HI;
+  int to = full ? CURRENT_SOFT_CUT_OFF_LO : (servo->curve ? CURVE_BUFFER : VOLTAGE_LO);
+
+  total += cost(TRANSACTION_READ, to - from + 1);
+
+  return (uint64_t) total;
+
+}
+
+uint64_t ServoBus::predict(bool full) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  if (!model.calibrated) return 0;
+
+  uint64_t total = 0;
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+    if ((*it)->responsive)
+      total += predict(it->get(), full);
+  }
+
+  return total;
+
+}
+
+/*
+  Skipped registers worth reading to save a separate read transaction, the
+  overhead of a read expressed in bytes.
+*/
+int ServoBus::mergeGap() const {
+
+  if (!model.calibrated || model.per_byte[TRANSACTION_READ] <= 0)
+    return READ_MERGE_GAP;
+
+  return std::min(SERVO_MAX_SPACE, (int) (model.overhead[TRANSACTION_READ] / model.per_byte[TRANSACTION_READ]));
+
+}
+
+vector<ServoHandler> ServoBus::quarantined() {
+
+  vector<ServoHandler> result;
+
+  for (vector<ServoHandler>::iterator it = servos.begin(); it != servos.end(); it++) {
+    if (!(*it)->responsive)
+      result.push_back(*it);
+  }
+
+  return result;
+
+}
+
+bool ServoBus::exportTelemetry(const string& name, int capacity) {
+
+  std::unique_ptr<TelemetryWriter> writer(new TelemetryWriter());
+
+  if (!writer->open(name, capacity))
+    return false;
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  telemetry = std::move(writer);
+
+  return true;
+
+}
+
+void ServoBus::stopTelemetry() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  telemetry.reset();
+
+}
+
+bool ServoBus::start(int period, bool full) {
+
+  if (!handle || polling) return false;
+
+  uint64_t predicted = predict(full);
+
+  if (predicted > (uint64_t) period) {
+    DEBUGMSG("Predicted update duration %lu us exceeds polling period %d us\n", (unsigned long) predicted, period);
+    error(ERROR_OVERLOAD);
+  }
+
+  poll_period = period;
+  poll_full = full;
+  polling = true;
+
+  poller = std::thread(&ServoBus::poll, this);
+
+  return true;
+
+}
+
+void ServoBus::stop() {
+
+  if (!polling) return;
+
+  polling = false;
+
+  if (poller.joinable())
+    poller.join();
+
+  poll_signal.notify_all();
+
+}
+
+/*
+  Stop the poller and the executor thread, completing work that is still
+  queued. The executor is started again by the next submission.
+*/
+void ServoBus::halt() {
+
+  stop();
+
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    executing = false;
+  }
+
+  task_signal.notify_all();
+
+  if (executor.joinable())
+    executor.join();
+
+}
+
+/*
+  Queue work for the executor thread, starting it if needed. Work still
+  queued when the bus is destroyed is completed first.
+*/
+std::future<bool> ServoBus::submit(std::function<bool()> work) {
+
+  std::shared_ptr<std::packaged_task<bool()> > task(new std::packaged_task<bool()>(work));
+  std::future<bool> result = task->get_future();
+
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+
+    if (!executing) {
+      executing = true;
+      executor = std::thread(&ServoBus::run, this);
+    }
+
+    tasks.push_back([task] { (*task)(); });
+  }
+
+  task_signal.notify_one();
+
+  return result;
+
+}
+
+void ServoBus::run() {
+
+  std::unique_lock<std::mutex> lock(task_mutex);
+
+  while (true) {
+
+    while (executing && tasks.empty())
+      task_signal.wait(lock);
+
+    if (tasks.empty()) return;
+
+    std::function<void()> task = std::move(tasks.front());
+    tasks.pop_front();
+
+    lock.unlock();
+    task();
+    completed();
+    lock.lock();
+
+  }
+
+}
+
+void ServoBus::completed() {
+
+  int fd = completion;
+
+  if (fd < 0) return;
+
+  uint64_t one = 1;
+
+  if (write(fd, &one, sizeof(one)) < 0) {
+    // the counter saturated, the reader is far behind and already readable
+  }
+
+}
+
+int ServoBus::getEventFd() {
+
+  std::lock_guard<std::mutex> lock(task_mutex);
+
+  if (completion < 0)
+    completion = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  return completion;
+
+}
+
+std::future<bool> ServoBus::updateAsync(bool full) {
+
+  return submit([this, full] { return update(full); });
+
+}
+
+std::future<bool> ServoBus::flushAsync() {
+
+  return submit([this] { return flush(); });
+
+}
+
+std::future<bool> ServoBus::refreshAsync(bool full) {
+
+  return submit([this, full] { return refresh(full); });
+
+}
+
+bool ServoBus::isPolling() const {
+
+  return polling;
+
+}
+
+bool ServoBus::wait(int timeout) {
+
+  if (!polling) return false;
+
+  std::unique_lock<std::mutex> lock(poll_mutex);
+
+  unsigned long cycles = poll_cycles;
+
+  return poll_signal.wait_for(lock, std::chrono::microseconds(timeout),
+    [&] { return poll_cycles != cycles || !polling; }) && poll_cycles != cycles;
+
+}
+
+bool ServoBus::setRealtime(const RealtimeConfig& config) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  bool success = true;
+
+  if (config.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    success = false;
+
+  reserve();
+
+  realtime = true;
+  realtime_config = config;
+
+  if (polling && !apply_realtime(poller.native_handle(), config))
+    success = false;
+
+  return success;
+
+}
+
+/*
+  Poller thread, updates all servos every poll period and wakes up threads
+  blocked in wait. Cycles that overrun the period are not made up for.
+*/
+void ServoBus::poll() {
+
+  if (realtime)
+    apply_realtime(pthread_self(), realtime_config);
+
+  uint64_t next = timestamp();
+
+  while (polling) {
+
+    {
+      std::lock_guard<BusMutex> lock(mutex);
+      update(poll_status, poll_full);
+    }
+
+    // the first cycle may still grow buffers, later ones are steady state
+    if (realtime)
+      trackAllocations(true);
+
+    {
+      std::lock_guard<std::mutex> lock(poll_mutex);
+      poll_cycles++;
+    }
+
+    poll_signal.notify_all();
+
+    completed();
+
+    next += poll_period;
+
+    uint64_t now = timestamp();
+
+    if (next > now)
+      std::this_thread::sleep_for(std::chrono::microseconds(next - now));
+    else
+      next = now;
+
+  }
+
+}
+
+ServoHandler ServoBus::get(int i) {
+
+  return servos[i];
+
+}
+
+int ServoBus::size() {
+  return servos.size();
+}
+
+int ServoBus::cleanupServos()
+{
+  if (!handle)
+    return -1;
 
   unsigned char tmp[128];
   int count = i2c_scan((i2c_handle)handle, tmp);
@@ -618,11 +3087,156 @@ bool ServoBus::exists(int address) {
 
 }
 
+/*
+  Take the inter-process lock for the given scope. Nested scopes (a cycle and
+  the transactions within it) only count the depth, so the adapter is locked
+  once by the outermost scope that the locking mode covers.
+*/
+void ServoBus::acquire(BusLocking scope) {
+
+  if (locking == LOCKING_NONE || scope > locking || !handle)
+    return;
+
+  if (lock_depth++ > 0)
+    return;
+
+  uint64_t started = timestamp();
+
+  // a process that stalls while holding the lock must not hang the update
+  // loop, the wait is bounded by the deadline and the cycle budget if set
+  int timeout = policy.deadline > 0 ? policy.deadline : -1;
+
+  if (policy.budget > 0 && (timeout < 0 || policy.budget < timeout))
+    timeout = policy.budget;
+
+  int r = i2c_lock((i2c_handle)handle, timeout);
+
+  if (r == I2C_ERROR_TIMEOUT) {
+    uint64_t waited = timestamp() - started;
+    lock_stats.timeouts++;
+    lock_stats.waited += waited;
+    lock_stats.longest = std::max(lock_stats.longest, waited);
+    result = r;
+    error(ERROR_LOCK);
+    lock_depth = 0;
+    return;
+  }
+
+  if (r < 0) {
+    // arbitration is advisory, a bus that can not be locked is still used
+    lock_stats.failed++;
+    lock_depth = 0;
+    return;
+  }
+
+  lock_stats.acquired++;
+
+  if (r == I2C_LOCK_CONTENDED) {
+    uint64_t waited = timestamp() - started;
+    lock_stats.contended++;
+    lock_stats.waited += waited;
+    lock_stats.longest = std::max(lock_stats.longest, waited);
+  }
+
+}
+
+void ServoBus::release(BusLocking scope) {
+
+  if (locking == LOCKING_NONE || scope > locking || !handle || lock_depth == 0)
+    return;
+
+  if (--lock_depth == 0)
+    i2c_unlock((i2c_handle)handle);
+
+}
+
+void ServoBus::setLocking(BusLocking mode) {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  if (lock_depth > 0) {
+    i2c_unlock((i2c_handle)handle);
+    lock_depth = 0;
+  }
+
+  locking = mode;
+
+}
+
+BusLocking ServoBus::getLocking() const {
+
+  return locking;
+
+}
+
+LockStatistics ServoBus::getLockStatistics() {
+
+  std::lock_guard<BusMutex> lock(mutex);
+
+  return lock_stats;
+
+}
+
+/*
+  Single logical transaction: select the servo, write the request and
+  optionally read a response, retried according to the bus policy.
+*/
+bool ServoBus::transfer(TransactionClass type, unsigned char address, unsigned char* request, int request_len, unsigned char* response, int response_len) {
+
+  uint64_t started = timestamp();
+
+  for (int attempt = 0; retry(type, started, attempt); attempt++) {
+
+    // the lock is released between attempts so that a retry backoff does
+    // not stall other processes
+    Arbitration arbitration(this, LOCKING_TRANSACTION);
+
+    if ((result = i2c_select((i2c_handle)handle, address)) != 0)
+      continue;
+
+    if ((result = i2c_write((i2c_handle)handle, request, request_len)) != 0)
+      continue;
+
+    if (response_len < 1)
+      return true;
+
+    if ((result = i2c_read((i2c_handle)handle, response, response_len)) == I2C_OK)
+      return true;
+
+  }
+
+  return false;
+
+}
+
+/*
+  Combined transfer of several messages, retried as a whole.
+*/
+bool ServoBus::batch(i2c_message* messages, int count) {
+
+  uint64_t started = timestamp();
+
+  for (int attempt = 0; retry(TRANSACTION_WRITE, started, attempt); attempt++) {
+
+    Arbitration arbitration(this, LOCKING_TRANSACTION);
+
+    if ((result = i2c_transfer((i2c_handle)handle, messages, count)) == I2C_OK)
+      return true;
+
+    if (result == I2C_ERROR_UNSUPPORTED)
+      return false;
+
+  }
+
+  return false;
+
+}
+
 // writing data to servo
 bool ServoBus::send(unsigned char address, unsigned char data_addr, unsigned char* data, int data_len) {
 
-  if (i2c_select((i2c_handle)handle, address) != 0)
-    return false;
+  if (checked && data_len > 0)
+    return sendChecked(address, data_addr, data, data_len);
 
   // If data_len == 0 then we have a command
   if (data_len < 1) {
@@ -639,23 +3253,152 @@ bool ServoBus::send(unsigned char address, unsigned char data_addr, unsigned cha
   if (data_len > 0)
     memcpy(&tmp_ch[1], data, data_len);
 
-  return i2c_write((i2c_handle)handle, tmp_ch, data_len + 1) == 0;
+  TransactionClass type = data_len < 1 ? TRANSACTION_COMMAND : TRANSACTION_WRITE;
+
+  return transfer(type, address, tmp_ch, data_len + 1, NULL, 0);
 
 }
 
 // read data from servo
 bool ServoBus::receive(unsigned char address, unsigned char data_addr, unsigned char* data, int data_len)
 {
-  if (i2c_select((i2c_handle)handle, address) != 0)
-    return false;
+
+  if (checked)
+    return receiveChecked(address, data_addr, data, data_len);
 
   // first, send data address (7th bit denotes command or address)
   data_addr &= 0x7F;
-  if (i2c_write((i2c_handle)handle, &data_addr, 1) != 0)
-    return false;
 
-  // read the data
-  return i2c_read((i2c_handle)handle, data, data_len) == 0;
+  return transfer(TRANSACTION_READ, address, &data_addr, 1, data, data_len);
+
+}
+
+unsigned char checksum(const unsigned char* header, int header_len, const unsigned char* data, int data_len) {
+
+  unsigned char sum = 0;
+
+  for (int i = 0; i < header_len; i++)
+    sum += header[i];
+
+  for (int i = 0; i < data_len; i++)
+    sum += data[i];
+
+  return sum;
+
+}
+
+/*
+  Checked write: CHECKED_TXN, register address, length, data and the sum of
+  address, length and data. The servo NAKs the checksum byte of a corrupted
+  block, which is then resent. Blocks are limited by the servo buffer size.
+*/
+bool ServoBus::sendChecked(unsigned char address, unsigned char data_addr, unsigned char* data, int data_len) {
+
+  unsigned char request[I2C_MAX_DATA_LEN];
+
+  for (int offset = 0; offset < data_len; offset += CHECKED_WRITE_BLOCK) {
+
+    int length = min(CHECKED_WRITE_BLOCK, data_len - offset);
+
+    request[0] = CHECKED_TXN;
+    request[1] = (data_addr + offset) & 0x7F;
+    request[2] = length;
+    memcpy(&request[3], &data[offset], length);
+    request[length + 3] = checksum(&request[1], 2, &data[offset], length);
+
+    for (int attempt = 0; ; attempt++) {
+
+      if (transfer(TRANSACTION_WRITE, address, request, length + 4, NULL, 0))
+        break;
+
+      if (result != I2C_ERROR_NACK_DATA)
+        return false;
+
+      corrupted[address & 0x7F]++;
+      result = BUS_CHECKSUM_MISMATCH;
+
+      if (attempt >= checked_retries)
+        return false;
+
+    }
+
+  }
+
+  return true;
+
+}
+
+/*
+  Checked read: CHECKED_TXN, register address and length are written, the
+  servo responds with the data followed by the sum of address, length and
+  data. Only the block with a checksum mismatch is read again.
+*/
+bool ServoBus::receiveChecked(unsigned char address, unsigned char data_addr, unsigned char* data, int data_len) {
+
+  unsigned char request[3];
+  unsigned char response[I2C_MAX_DATA_LEN];
+
+  for (int offset = 0; offset < data_len; offset += CHECKED_READ_BLOCK) {
+
+    int length = min(CHECKED_READ_BLOCK, data_len - offset);
+
+    request[0] = CHECKED_TXN;
+    request[1] = (data_addr + offset) & 0x7F;
+    request[2] = length;
+
+    for (int attempt = 0; ; attempt++) {
+
+      if (!transfer(TRANSACTION_READ, address, request, 3, response, length + 1))
+        return false;
+
+      if (checksum(&request[1], 2, response, length) == response[length])
+        break;
+
+      corrupted[address & 0x7F]++;
+      result = BUS_CHECKSUM_MISMATCH;
+
+      if (attempt >= checked_retries)
+        return false;
+
+    }
+
+    memcpy(&data[offset], response, length);
+
+  }
+
+  return true;
+
+}
+
+void ServoBus::setChecked(bool enabled, int retries) {
+
+  checked = enabled;
+  checked_retries = retries;
+
+}
+
+void ServoBus::setReadbackElision(bool enabled) {
+
+  elision = enabled;
+
+}
+
+bool ServoBus::isChecked() const {
+
+  return checked;
+
+}
+
+unsigned long ServoBus::getCorruptions(int address) const {
+
+  if (address < 0) {
+    unsigned long total = 0;
+    for (int i = 0; i < 128; i++)
+      total += corrupted[i];
+    return total;
+  }
+
+  return corrupted[address & 0x7F];
 
 }
 
@@ -0,0 +1,237 @@
+#include "openservo_telemetry.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace openservo {
+
+TelemetryWriter::TelemetryWriter(): size(0), header(NULL), records(NULL) {
+
+}
+
+TelemetryWriter::~TelemetryWriter() {
+
+  close();
+
+}
+
+bool TelemetryWriter::open(const string& name, int capacity) {
+
+  close();
+
+  if (capacity < 1) return false;
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+
+  if (fd < 0) return false;
+
+  size_t length = sizeof(TelemetryHeader) + sizeof(TelemetryRecord) * TELEMETRY_SERVOS * capacity;
+
+  if (ftruncate(fd, length) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void* region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  ::close(fd);
+
+  if (region == MAP_FAILED) return false;
+
+  memset(region, 0, length);
+
+  this->name = name;
+  size = length;
+  header = (TelemetryHeader*) region;
+  records = (TelemetryRecord*) (header + 1);
+
+  header->version = TELEMETRY_VERSION;
+  header->capacity = capacity;
+  header->record_size = sizeof(TelemetryRecord);
+
+  // readers check the magic last, once the layout is complete
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = TELEMETRY_MAGIC;
+
+  return true;
+
+}
+
+void TelemetryWriter::close() {
+
+  if (!header) return;
+
+  munmap(header, size);
+  shm_unlink(name.c_str());
+
+  header = NULL;
+  records = NULL;
+  size = 0;
+
+}
+
+bool TelemetryWriter::isOpen() const {
+
+  return header != NULL;
+
+}
+
+void TelemetryWriter::publish(int address, UpdateStatus status, uint64_t timestamp, const unsigned char* registers) {
+
+  if (!header) return;
+
+  address &= TELEMETRY_SERVOS - 1;
+
+  uint64_t index = header->heads[address].load(std::memory_order_relaxed);
+  TelemetryRecord& record = records[address * header->capacity + index % header->capacity];
+
+  record.sequence.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  record.sample.timestamp = timestamp;
+  record.sample.address = address;
+  record.sample.status = status;
+  memcpy(record.sample.registers, registers, SERVO_MAX_SPACE);
+
+  record.sequence.store(2 * index + 2, std::memory_order_release);
+  header->heads[address].store(index + 1, std::memory_order_release);
+
+}
+
+TelemetryReader::TelemetryReader(): size(0), header(NULL), records(NULL) {
+
+}
+
+TelemetryReader::~TelemetryReader() {
+
+  close();
+
+}
+
+bool TelemetryReader::open(const string& name) {
+
+  close();
+
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+  if (fd < 0) return false;
+
+  struct stat info;
+
+  if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(TelemetryHeader)) {
+    ::close(fd);
+    return false;
+  }
+
+  void* region = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  ::close(fd);
+
+  if (region == MAP_FAILED) return false;
+
+  const TelemetryHeader* candidate = (const TelemetryHeader*) region;
+
+  if (candidate->magic != TELEMETRY_MAGIC || candidate->version != TELEMETRY_VERSION ||
+      candidate->record_size != sizeof(TelemetryRecord) ||
+      sizeof(TelemetryHeader) + sizeof(TelemetryRecord) * TELEMETRY_SERVOS * candidate->capacity > (size_t) info.st_size) {
+    munmap(region, info.st_size);
+    return false;
+  }
+
+  size = info.st_size;
+  header = candidate;
+  records = (const TelemetryRecord*) (header + 1);
+
+  return true;
+
+}
+
+void TelemetryReader::close() {
+
+  if (!header) return;
+
+  munmap((void*) header, size);
+
+  header = NULL;
+  records = NULL;
+  size = 0;
+
+}
+
+bool TelemetryReader::isOpen() const {
+
+  return header != NULL;
+
+}
+
+int TelemetryReader::capacity() const {
+
+  return header ? header->capacity : 0;
+
+}
+
+uint64_t TelemetryReader::count(int address) const {
+
+  if (!header) return 0;
+
+  return header->heads[address & (TELEMETRY_SERVOS - 1)].load(std::memory_order_acquire);
+
+}
+
+const TelemetrySample* TelemetryReader::at(int address, uint64_t index) const {
+
+  if (!header) return NULL;
+
+  address &= TELEMETRY_SERVOS - 1;
+
+  const TelemetryRecord& record = records[address * header->capacity + index % header->capacity];
+
+  if (record.sequence.load(std::memory_order_acquire) != 2 * index + 2)
+    return NULL;
+
+  return &record.sample;
+
+}
+
+const TelemetrySample* TelemetryReader::latest(int address, uint64_t* index) const {
+
+  uint64_t n = count(address);
+
+  if (n == 0) return NULL;
+
+  if (index) *index = n - 1;
+
+  return at(address, n - 1);
+
+}
+
+bool TelemetryReader::isValid(int address, uint64_t index) const {
+
+  if (!header) return false;
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  address &= TELEMETRY_SERVOS - 1;
+
+  const TelemetryRecord& record = records[address * header->capacity + index % header->capacity];
+
+  return record.sequence.load(std::memory_order_relaxed) == 2 * index + 2;
+
+}
+
+bool TelemetryReader::copy(int address, uint64_t index, TelemetrySample& sample) const {
+
+  const TelemetrySample* source = at(address, index);
+
+  if (!source) return false;
+
+  sample = *source;
+
+  return isValid(address, index);
+
+}
+
+}
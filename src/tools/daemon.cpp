@@ -0,0 +1,514 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <openservo.h>
+#include <openservo_protocol.h>
+
+using namespace std;
+using namespace openservo;
+
+#define CMD_OPTIONS "hvl:s:p:"
+#define MAX_CLIENTS 64
+// Unsent response bytes a client may accumulate before it is dropped
+#define MAX_OUTPUT (1 << 20)
+
+struct Client {
+	int fd;
+	bool failed;
+	vector<unsigned char> input;
+	vector<unsigned char> output;
+};
+
+// Request whose response is sent once the next bus cycle completes
+struct Pending {
+	int fd;
+	ProtocolHeader header;
+	vector<ProtocolEntry> entries;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int) {
+
+	running = 0;
+
+}
+
+void print_help() {
+
+    cout << "Own OpenServo buses and serve register requests of local clients" << endl << endl;
+
+    cout << " openservod -h -v -l Location1 -l Location2 ... -s Socket -p Period" << endl << endl;
+
+    cout << "Program configuration: \n";
+    cout << "\t-h\tPrint this help and exit\n";
+    cout << "\t-v\tVerbose output\n";
+    cout << "\t-l\tAdd i2c device location, buses are numbered in order\n";
+    cout << "\t-s\tUnix socket path (default " << OPENSERVOD_SOCKET << ")\n";
+    cout << "\t-p\tBus cycle period in microseconds (default 10000)\n";
+
+    cout << "\n";
+}
+
+/*
+  Send as much of the queued output as the socket accepts, the rest is sent
+  once the socket polls writable again. Returns false if the client is gone.
+*/
+bool drain_client(Client& client) {
+
+	size_t sent = 0;
+
+	while (sent < client.output.size()) {
+		ssize_t n = send(client.fd, client.output.data() + sent, client.output.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n <= 0) return false;
+		sent += n;
+	}
+
+	client.output.erase(client.output.begin(), client.output.begin() + sent);
+
+	return true;
+
+}
+
+// Queue a frame behind earlier output so that frames are never interleaved
+bool send_frame(Client& client, const ProtocolHeader& header, const vector<ProtocolEntry>& entries) {
+
+	const unsigned char* h = (const unsigned char*) &header;
+	const unsigned char* e = (const unsigned char*) entries.data();
+
+	client.output.insert(client.output.end(), h, h + sizeof(ProtocolHeader));
+	client.output.insert(client.output.end(), e, e + entries.size() * sizeof(ProtocolEntry));
+
+	if (client.output.size() > MAX_OUTPUT || !drain_client(client))
+		client.failed = true;
+
+	return !client.failed;
+
+}
+
+ServoHandler lookup(vector<unique_ptr<ServoBus> >& buses, const ProtocolEntry& entry) {
+
+	if (entry.bus >= buses.size()) return ServoHandler();
+
+	return buses[entry.bus]->find(entry.address);
+
+}
+
+/*
+  GET entries are answered from the register cache right away. Requests that
+  only contain GET entries are answered immediately, others wait for the
+  next cycle so that their response reflects the outcome of the writes.
+*/
+bool handle_request(vector<unique_ptr<ServoBus> >& buses, Client& client, const ProtocolHeader& header,
+	const ProtocolEntry* entries, deque<Pending>& pending) {
+
+	Pending request;
+	request.fd = client.fd;
+	request.header = header;
+	request.header.type = PROTOCOL_RESPONSE;
+	request.entries.assign(entries, entries + header.count);
+
+	bool deferred = false;
+
+	for (vector<ProtocolEntry>::iterator it = request.entries.begin(); it != request.entries.end(); it++) {
+
+		it->status = PROTOCOL_OK;
+
+		if (it->operation == PROTOCOL_COMMAND && it->address == 0) {
+			if (it->bus >= buses.size()) it->status = PROTOCOL_NOT_FOUND;
+			deferred = true;
+			continue;
+		}
+
+		ServoHandler s = lookup(buses, *it);
+
+		if (!s) {
+			it->status = PROTOCOL_NOT_FOUND;
+			continue;
+		}
+
+		switch (it->operation) {
+		case PROTOCOL_GET: {
+			string name = s->getName(it->reg);
+			if (name.empty())
+				it->status = PROTOCOL_NOT_FOUND;
+			else
+				it->value = s->get(name);
+			break;
+		}
+		case PROTOCOL_SET:
+		case PROTOCOL_COMMAND:
+			deferred = true;
+			break;
+		default:
+			it->status = PROTOCOL_INVALID;
+		}
+
+	}
+
+	if (!deferred)
+		return send_frame(client, request.header, request.entries);
+
+	pending.push_back(request);
+
+	return true;
+
+}
+
+bool run_command(ServoBus& bus, ServoHandler s, int command, bool& valid) {
+
+	valid = true;
+
+	if (!s) {
+		switch (command) {
+		case PROTOCOL_COMMAND_RESET: return bus.resetAll();
+		case PROTOCOL_COMMAND_ENABLE: return bus.enableAll();
+		case PROTOCOL_COMMAND_DISABLE: return bus.disableAll();
+		}
+	} else {
+		switch (command) {
+		case PROTOCOL_COMMAND_RESET: return s->reset();
+		case PROTOCOL_COMMAND_ENABLE: return s->enable();
+		case PROTOCOL_COMMAND_DISABLE: return s->disable();
+		case PROTOCOL_COMMAND_SAVE: return s->registersCommit();
+		case PROTOCOL_COMMAND_RESTORE: return s->registersRestore();
+		case PROTOCOL_COMMAND_DEFAULT: return s->registersDefault();
+		}
+	}
+
+	valid = false;
+	return false;
+
+}
+
+/*
+  One bus cycle: commands of all queued requests are sent in arrival order,
+  writes only mark the register cache dirty so that writes of all clients to
+  the same register coalesce into a single batched flush per bus. Status
+  registers are read back afterwards and every queued request is answered.
+*/
+void cycle(vector<unique_ptr<ServoBus> >& buses, vector<Client>& clients, deque<Pending>& pending, bool verbose) {
+
+	for (deque<Pending>::iterator request = pending.begin(); request != pending.end(); request++) {
+
+		for (vector<ProtocolEntry>::iterator it = request->entries.begin(); it != request->entries.end(); it++) {
+
+			if (it->status != PROTOCOL_OK) continue;
+
+			ServoHandler s = lookup(buses, *it);
+
+			if (it->operation == PROTOCOL_SET) {
+
+				string name = s->getName(it->reg);
+
+				if (name.empty())
+					it->status = PROTOCOL_NOT_FOUND;
+				else if (!s->set(name, it->value))
+					it->status = PROTOCOL_READONLY;
+
+			} else if (it->operation == PROTOCOL_COMMAND) {
+
+				bool valid;
+
+				if (!run_command(*buses[it->bus], it->address ? s : ServoHandler(), it->reg, valid))
+					it->status = valid ? PROTOCOL_FAILED : PROTOCOL_INVALID;
+
+			}
+
+		}
+
+	}
+
+	vector<bool> flushed(buses.size());
+
+	for (size_t i = 0; i < buses.size(); i++) {
+
+		flushed[i] = buses[i]->flush();
+
+		if (!buses[i]->refresh() && verbose)
+			cout << "Bus " << i << ": " << buses[i]->getLastError() << endl;
+
+	}
+
+	while (!pending.empty()) {
+
+		Pending& request = pending.front();
+
+		for (vector<ProtocolEntry>::iterator it = request.entries.begin(); it != request.entries.end(); it++) {
+
+			if (it->operation == PROTOCOL_SET && it->status == PROTOCOL_OK && !flushed[it->bus])
+				it->status = PROTOCOL_FAILED;
+
+		}
+
+		for (size_t i = 0; i < clients.size(); i++) {
+			if (clients[i].fd == request.fd) {
+				send_frame(clients[i], request.header, request.entries);
+				break;
+			}
+		}
+
+		pending.pop_front();
+
+	}
+
+}
+
+int open_socket(const string& path) {
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0) return -1;
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(address.sun_path)) {
+		close(fd);
+		return -1;
+	}
+
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+	unlink(path.c_str());
+
+	if (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(fd, MAX_CLIENTS) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+
+}
+
+void drop_client(vector<Client>& clients, size_t i, deque<Pending>& pending) {
+
+	int fd = clients[i].fd;
+
+	// Writes of a client that went away are still applied, only the
+	// response is not delivered anywhere
+	for (deque<Pending>::iterator it = pending.begin(); it != pending.end(); it++) {
+		if (it->fd == fd) it->fd = -1;
+	}
+
+	close(fd);
+	clients.erase(clients.begin() + i);
+
+}
+
+/*
+  Consume complete frames from the client input buffer, returns false if
+  the client sent a malformed frame or its response could not be sent.
+*/
+bool read_client(vector<unique_ptr<ServoBus> >& buses, Client& client, deque<Pending>& pending) {
+
+	unsigned char buffer[4096];
+
+	ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) return true;
+	if (n <= 0) return false;
+
+	client.input.insert(client.input.end(), buffer, buffer + n);
+
+	size_t offset = 0;
+
+	while (client.input.size() - offset >= sizeof(ProtocolHeader)) {
+
+		ProtocolHeader header;
+		memcpy(&header, client.input.data() + offset, sizeof(ProtocolHeader));
+
+		if (header.magic != PROTOCOL_MAGIC || header.type != PROTOCOL_REQUEST || header.count > PROTOCOL_MAX_ENTRIES)
+			return false;
+
+		size_t length = sizeof(ProtocolHeader) + header.count * sizeof(ProtocolEntry);
+
+		if (client.input.size() - offset < length) break;
+
+		vector<ProtocolEntry> entries(header.count);
+		if (header.count)
+			memcpy(entries.data(), client.input.data() + offset + sizeof(ProtocolHeader), header.count * sizeof(ProtocolEntry));
+
+		if (!handle_request(buses, client, header, entries.data(), pending))
+			return false;
+
+		offset += length;
+
+	}
+
+	client.input.erase(client.input.begin(), client.input.begin() + offset);
+
+	return true;
+
+}
+
+int main(int argc, char** argv) {
+
+	bool verbose = false;
+	vector<string> locations;
+	string path = OPENSERVOD_SOCKET;
+	int period = 10000;
+	int c;
+
+	while ((c = getopt(argc, argv, CMD_OPTIONS)) != -1)
+	    switch (c) {
+	    case 'h':
+	        print_help();
+	        exit(0);
+	    case 'v':
+	        verbose = true;
+	        break;
+	    case 'l':
+	        locations.push_back(string(optarg));
+	        break;
+	    case 's':
+	        path = string(optarg);
+	        break;
+	    case 'p':
+	        period = atoi(optarg);
+	        break;
+	    default:
+	        print_help();
+	        throw std::runtime_error(string("Unknown switch -") + string(1, (char) optopt));
+	    }
+
+	if (locations.empty())
+		locations.push_back(string());
+
+	if (period < 1000) period = 1000;
+
+	vector<unique_ptr<ServoBus> > buses;
+
+	for (size_t i = 0; i < locations.size(); i++) {
+
+		unique_ptr<ServoBus> bus(new ServoBus());
+
+		if (!bus->open(locations[i])) {
+			cout << "Unable to connect to i2c bus " << locations[i] << endl;
+			return -1;
+		}
+
+		int n = bus->scan();
+
+		if (verbose)
+			cout << "Bus " << i << " (" << locations[i] << "): " << n << " servos" << endl;
+
+		buses.push_back(std::move(bus));
+
+	}
+
+	int server = open_socket(path);
+
+	if (server < 0) {
+		cout << "Unable to listen on " << path << endl;
+		return -1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	vector<Client> clients;
+	deque<Pending> pending;
+	vector<struct pollfd> descriptors;
+
+	uint64_t next = timestamp();
+
+	while (running) {
+
+		uint64_t now = timestamp();
+
+		if (now >= next) {
+
+			cycle(buses, clients, pending, verbose);
+
+			next += period;
+			// Do not try to catch up on missed cycles
+			if (next < now) next = now + period;
+
+			continue;
+
+		}
+
+		descriptors.resize(clients.size() + 1);
+		descriptors[0].fd = server;
+		descriptors[0].events = POLLIN;
+
+		for (size_t i = 0; i < clients.size(); i++) {
+			descriptors[i + 1].fd = clients[i].fd;
+			descriptors[i + 1].events = clients[i].output.empty() ? POLLIN : POLLIN | POLLOUT;
+		}
+
+		int timeout = (int) ((next - now + 999) / 1000);
+
+		if (poll(descriptors.data(), descriptors.size(), timeout) <= 0)
+			continue;
+
+		// Clients are handled from the back so that dropping one keeps the
+		// indices of the remaining descriptors valid
+		for (size_t i = clients.size(); i > 0; i--) {
+
+			Client& client = clients[i - 1];
+			short events = descriptors[i].revents;
+
+			if ((events & POLLOUT) && !drain_client(client))
+				client.failed = true;
+
+			if ((events & (POLLIN | POLLHUP)) && !client.failed && !read_client(buses, client, pending))
+				client.failed = true;
+
+			if ((events & (POLLERR | POLLNVAL)) || client.failed) {
+				if (verbose) cout << "Client " << clients[i - 1].fd << " disconnected" << endl;
+				drop_client(clients, i - 1, pending);
+			}
+
+		}
+
+		if (descriptors[0].revents & POLLIN) {
+
+			int fd;
+
+			while ((fd = accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+
+				if (clients.size() >= MAX_CLIENTS) {
+					close(fd);
+					continue;
+				}
+
+				Client client;
+				client.fd = fd;
+				client.failed = false;
+				clients.push_back(client);
+
+				if (verbose) cout << "Client " << fd << " connected" << endl;
+
+			}
+
+		}
+
+	}
+
+	for (size_t i = 0; i < clients.size(); i++)
+		close(clients[i].fd);
+
+	close(server);
+	unlink(path.c_str());
+
+	return 0;
+
+}
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "debug.h"
+
+typedef struct trace_recorder {
+  i2c_handle inner;
+  FILE* file;
+  uint64_t start;
+} trace_recorder;
+
+typedef struct trace_player {
+  const unsigned char* map;
+  size_t size;
+  size_t cursor;            // offset of the next record to serve
+  double speed;             // 0 serves immediately, otherwise divides recorded durations
+  int file;
+  // set for addresses whose last write had no recorded counterpart, the
+  // register pointer of such a device is unknown until the next matched write
+  unsigned char diverged[128];
+} trace_player;
+
+static uint64_t trace_now() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Wrap an open transport so that every transaction passed to it is appended
+ * to the trace file. The recorder owns the inner handle from now on.
+ */
+i2c_handle i2c_record(const char* filename, i2c_handle inner) {
+
+  if (!inner)
+    return NULL;
+
+  FILE* file = fopen(filename, "wb");
+
+  if (!file) {
+    i2c_close(&inner);
+    return NULL;
+  }
+
+  trace_recorder* recorder = (trace_recorder*) malloc(sizeof(trace_recorder));
+  recorder->inner = inner;
+  recorder->file = file;
+  recorder->start = trace_now();
+
+  // records are buffered, a trace is only complete once the handle is closed
+  setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+  trace_header header = {TRACE_MAGIC, TRACE_VERSION, recorder->start};
+  fwrite(&header, sizeof(header), 1, file);
+
+  DEBUGMSG("Recording i2c traffic to %s \n", filename);
+
+  i2c_handle handle = (i2c_handle) malloc(sizeof(i2c_object));
+  handle->flags = I2C_RECORD;
+  handle->selected = 0;
+  handle->last_error = 0;
+  handle->data = recorder;
+  // processes sharing the recorded bus lock the real adapter
+  handle->lock = inner->lock;
+  handle->transferred = inner->transferred;
+  return handle;
+}
+
+/*
+ * Serve transactions from a recorded trace. With speed 1 every transaction
+ * takes as long as it did when recorded, larger values replay faster and 0
+ * as fast as possible.
+ */
+i2c_handle i2c_replay(const char* filename, double speed) {
+
+  int file = open(filename, O_RDONLY | O_CLOEXEC);
+
+  if (file < 0)
+    return NULL;
+
+  struct stat info;
+
+  if (fstat(file, &info) != 0 || (size_t) info.st_size < sizeof(trace_header)) {
+    close(file);
+    return NULL;
+  }
+
+  void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+  if (map == MAP_FAILED) {
+    close(file);
+    return NULL;
+  }
+
+  const trace_header* header = (const trace_header*) map;
+
+  if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION) {
+    munmap(map, info.st_size);
+    close(file);
+    return NULL;
+  }
+
+  trace_player* player = (trace_player*) malloc(sizeof(trace_player));
+  player->map = (const unsigned char*) map;
+  player->size = info.st_size;
+  player->cursor = sizeof(trace_header);
+  player->speed = speed < 0 ? 0 : speed;
+  player->file = file;
+  memset(player->diverged, 0, sizeof(player->diverged));
+
+  DEBUGMSG("Replaying i2c traffic from %s \n", filename);
+
+  i2c_handle handle = (i2c_handle) malloc(sizeof(i2c_object));
+  handle->flags = I2C_REPLAY;
+  handle->selected = 0;
+  handle->last_error = 0;
+  handle->data = player;
+  handle->lock = file;
+  handle->transferred = 0;
+  return handle;
+}
+
+int trace_close(i2c_handle handle) {
+
+  if (handle->flags == I2C_RECORD) {
+
+    trace_recorder* recorder = (trace_recorder*) handle->data;
+
+    fclose(recorder->file);
+    i2c_close(&recorder->inner);
+    free(recorder);
+
+    return 0;
+  }
+
+  if (handle->flags == I2C_REPLAY) {
+
+    trace_player* player = (trace_player*) handle->data;
+
+    munmap((void*) player->map, player->size);
+    close(player->file);
+    free(player);
+
+    return 0;
+  }
+
+  return -1;
+}
+
+static void trace_append(trace_recorder* recorder, uint64_t started, uint32_t duration, int address,
+    int direction, int messages, int result, const unsigned char* buffer, int length) {
+
+  trace_record record;
+  memset(&record, 0, sizeof(record));
+
+  record.timestamp = started - recorder->start;
+  record.duration = duration;
+  record.length = length;
+  record.address = address;
+  record.direction = direction;
+  record.messages = messages;
+  record.result = result;
+
+  fwrite(&record, sizeof(record), 1, recorder->file);
+
+  if (length > 0)
+    fwrite(buffer, 1, length, recorder->file);
+}
+
+/*
+ * Find the next record for the given transaction, skipping at most
+ * TRACE_RESYNC_WINDOW records that the replayed workload did not ask for.
+ * Writes must also agree on the register or command in their first byte. A
+ * read never skips a write to the same device, since the recorded read then
+ * returned a different register. Returns the record offset or 0 if there is
+ * none.
+ */
+static size_t trace_match(trace_player* player, int address, int direction, const unsigned char* buffer, int length) {
+
+  size_t offset = player->cursor;
+  int skipped;
+
+  for (skipped = 0; skipped <= TRACE_RESYNC_WINDOW; skipped++) {
+
+    trace_record record;
+
+    if (offset + sizeof(record) > player->size)
+      return 0;
+
+    memcpy(&record, player->map + offset, sizeof(record));
+
+    if (offset + sizeof(record) + record.length > player->size)
+      return 0;
+
+    if (record.address == address) {
+
+      if (direction == TRACE_READ) {
+        if (record.direction == TRACE_READ)
+          return offset;
+        return 0;
+      }
+
+      if (record.direction == TRACE_WRITE && (record.length == 0) == (length == 0) &&
+          (length == 0 || player->map[offset + sizeof(record)] == buffer[0]))
+        return offset;
+
+    }
+
+    offset += sizeof(record) + record.length;
+  }
+
+  return 0;
+}
+
+static int trace_serve(i2c_handle handle, int address, int direction, unsigned char* buffer, int length) {
+
+  trace_player* player = (trace_player*) handle->data;
+
+  address &= 0x7F;
+
+  size_t offset = 0;
+
+  if (direction == TRACE_WRITE || !player->diverged[address])
+    offset = trace_match(player, address, direction, buffer, length);
+
+  if (direction == TRACE_WRITE)
+    player->diverged[address] = !offset;
+
+  if (!offset) {
+    handle->last_error = player->cursor >= player->size ? ENODATA : EPROTO;
+    return I2C_ERROR;
+  }
+
+  trace_record record;
+  memcpy(&record, player->map + offset, sizeof(record));
+
+  if (direction == TRACE_READ) {
+    int n = record.length < length ? record.length : length;
+    memcpy(buffer, player->map + offset + sizeof(record), n);
+    memset(buffer + n, 0, length - n);
+  }
+
+  player->cursor = offset + sizeof(record) + record.length;
+
+  if (player->speed > 0 && record.duration > 0)
+    usleep((useconds_t) (record.duration / player->speed));
+
+  return record.result;
+}
+
+int trace_select(i2c_handle handle, int address) {
+
+  handle->selected = address;
+
+  if (handle->flags == I2C_RECORD) {
+    trace_recorder* recorder = (trace_recorder*) handle->data;
+    int result = i2c_select(recorder->inner, address);
+    handle->last_error = recorder->inner->last_error;
+    return result;
+  }
+
+  return 0;
+}
+
+int trace_read(i2c_handle handle, unsigned char* buffer, int length) {
+
+  if (handle->flags == I2C_RECORD) {
+
+    trace_recorder* recorder = (trace_recorder*) handle->data;
+
+    uint64_t started = trace_now();
+    int result = i2c_read(recorder->inner, buffer, length);
+
+    trace_append(recorder, started, trace_now() - started, handle->selected, TRACE_READ, 1, result, buffer, length);
+    handle->last_error = recorder->inner->last_error;
+
+    return result;
+  }
+
+  return trace_serve(handle, handle->selected, TRACE_READ, buffer, length);
+}
+
+int trace_write(i2c_handle handle, unsigned char* buffer, int length) {
+
+  if (handle->flags == I2C_RECORD) {
+
+    trace_recorder* recorder = (trace_recorder*) handle->data;
+
+    uint64_t started = trace_now();
+    int result = i2c_write(recorder->inner, buffer, length);
+
+    trace_append(recorder, started, trace_now() - started, handle->selected, TRACE_WRITE, 1, result, buffer, length);
+    handle->last_error = recorder->inner->last_error;
+
+    return result;
+  }
+
+  return trace_serve(handle, handle->selected, TRACE_WRITE, buffer, length);
+}
+
+int trace_transfer(i2c_handle handle, i2c_message* messages, int count) {
+
+  int i;
+
+  if (handle->flags == I2C_RECORD) {
+
+    trace_recorder* recorder = (trace_recorder*) handle->data;
+
+    uint64_t started = trace_now();
+    int result = i2c_transfer(recorder->inner, messages, count);
+    uint32_t duration = trace_now() - started;
+
+    for (i = 0; i < count; i++) {
+      trace_append(recorder, started, i == 0 ? duration : 0, messages[i].address,
+        messages[i].read ? TRACE_READ : TRACE_WRITE, count > 255 ? 255 : count, result,
+        messages[i].buffer, messages[i].length);
+    }
+
+    handle->last_error = recorder->inner->last_error;
+    handle->transferred = recorder->inner->transferred;
+
+    return result;
+  }
+
+  int result = I2C_OK;
+
+  handle->transferred = 0;
+
+  for (i = 0; i < count; i++) {
+
+    int r = trace_serve(handle, messages[i].address, messages[i].read ? TRACE_READ : TRACE_WRITE,
+      messages[i].buffer, messages[i].length);
+
+    if (r != I2C_OK && result == I2C_OK)
+      result = r;
+
+    if (result == I2C_OK)
+      handle->transferred++;
+  }
+
+  return result;
+}
+
+int trace_timeout(i2c_handle handle, int timeout) {
+
+  if (handle->flags == I2C_RECORD)
+    return i2c_timeout(((trace_recorder*) handle->data)->inner, timeout);
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+#include "i2c.h"
+
+#define TRACE_MAGIC 0x4F535443
+#define TRACE_VERSION 1
+
+#define TRACE_WRITE 0
+#define TRACE_READ 1
+
+// Records searched ahead for the requested transaction when replaying a
+// trace of a slightly different workload
+#define TRACE_RESYNC_WINDOW 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A trace is a trace_header followed by variable length records, each a
+ * trace_record immediately followed by length data bytes: the bytes written
+ * or the bytes returned by a read. Messages of a combined transfer are
+ * stored as consecutive records, the first one carries the duration of the
+ * whole transfer and all of them its result.
+ */
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start;         // monotonic time of the first record in microseconds
+} trace_header;
+
+typedef struct trace_record {
+    uint64_t timestamp;     // microseconds since the start of the recording
+    uint32_t duration;      // bus time of the transaction in microseconds
+    uint16_t length;
+    uint8_t address;
+    uint8_t direction;      // TRACE_WRITE or TRACE_READ
+    uint8_t messages;       // messages of the transaction this record belongs to
+    int8_t result;          // I2C_* result of the transaction
+    uint8_t reserved[6];
+} trace_record;
+
+int trace_close(i2c_handle handle);
+int trace_select(i2c_handle handle, int address);
+int trace_read(i2c_handle handle, unsigned char* buffer, int length);
+int trace_write(i2c_handle handle, unsigned char* buffer, int length);
+int trace_transfer(i2c_handle handle, i2c_message* messages, int count);
+int trace_timeout(i2c_handle handle, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
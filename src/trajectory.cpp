@@ -0,0 +1,291 @@
+#include "openservo_trajectory.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace openservo {
+
+Trajectory::Trajectory(int joints, ProfileType type): count(joints), type(type),
+  blend(0.25f), minimum(joints, 0.0f), maximum(joints, 65535.0f) {
+
+}
+
+Trajectory::~Trajectory() {
+
+}
+
+int Trajectory::joints() const {
+
+  return count;
+
+}
+
+int Trajectory::waypoints() const {
+
+  return times.size();
+
+}
+
+double Trajectory::duration() const {
+
+  if (times.size() < 2) return 0;
+
+  return times.back() - times.front();
+
+}
+
+void Trajectory::setLimits(int joint, int min, int max) {
+
+  minimum[joint] = min;
+  maximum[joint] = max;
+
+  if (times.empty()) return;
+
+  // waypoints added before are clamped to the new limits as well
+  for (size_t k = 0; k < times.size(); k++) {
+    float& position = points[k * count + joint];
+    position = std::max(minimum[joint], std::min(maximum[joint], position));
+  }
+
+  solve();
+
+}
+
+void Trajectory::setLimits(int joint, ServoHandler servo) {
+
+  setLimits(joint, servo->getMinSeek(), servo->getMaxSeek());
+
+}
+
+void Trajectory::setBlend(float value) {
+
+  blend = std::max(0.0f, std::min(0.5f, value));
+
+}
+
+bool Trajectory::addWaypoint(double time, const int* positions) {
+
+  if (!times.empty() && time <= times.back())
+    return false;
+
+  times.push_back(time);
+
+  for (int j = 0; j < count; j++) {
+    float position = std::max(minimum[j], std::min(maximum[j], (float) positions[j]));
+    points.push_back(position);
+  }
+
+  solve();
+
+  return true;
+
+}
+
+bool Trajectory::addWaypoint(double time, const vector<int>& positions) {
+
+  if ((int) positions.size() < count)
+    return false;
+
+  return addWaypoint(time, positions.data());
+
+}
+
+void Trajectory::clear() {
+
+  times.clear();
+  points.clear();
+  tangents.clear();
+
+}
+
+/*
+  Velocities at waypoints. The cubic profile uses the mean slope of the
+  neighbouring segments, set to zero where the motion changes direction and
+  limited to three times the smaller neighbouring slope (Fritsch-Carlson), so
+  that every segment is monotone and the curve does not overshoot a
+  waypoint. The trapezoidal profile and both ends of the trajectory come to
+  rest.
+*/
+void Trajectory::solve() {
+
+  int n = times.size();
+
+  tangents.assign(n * count, 0.0f);
+
+  if (type != PROFILE_CUBIC) return;
+
+  for (int k = 1; k < n - 1; k++) {
+
+    float before = (float) (times[k] - times[k - 1]);
+    float after = (float) (times[k + 1] - times[k]);
+
+    const float* previous = &points[(k - 1) * count];
+    const float* current = &points[k * count];
+    const float* next = &points[(k + 1) * count];
+    float* tangent = &tangents[k * count];
+
+    for (int j = 0; j < count; j++) {
+      float in = (current[j] - previous[j]) / before;
+      float out = (next[j] - current[j]) / after;
+      if (in * out <= 0) {
+        tangent[j] = 0.0f;
+        continue;
+      }
+      float limit = 3 * std::min(std::fabs(in), std::fabs(out));
+      tangent[j] = std::max(-limit, std::min(limit, 0.5f * (in + out)));
+    }
+
+  }
+
+}
+
+int Trajectory::segment(double time) const {
+
+  int k = std::upper_bound(times.begin(), times.end(), time) - times.begin() - 1;
+
+  return std::max(0, std::min(k, (int) times.size() - 2));
+
+}
+
+void Trajectory::sample(double time, int* positions, int* velocities) const {
+
+  int n = times.size();
+
+  if (n == 0) return;
+
+  if (n == 1 || time <= times.front() || time >= times.back()) {
+
+    const float* point = &points[(time >= times.back() ? n - 1 : 0) * count];
+
+    for (int j = 0; j < count; j++) {
+      positions[j] = (int) lrintf(point[j]);
+      if (velocities) velocities[j] = 0;
+    }
+
+    return;
+
+  }
+
+  int k = segment(time);
+
+  float h = (float) (times[k + 1] - times[k]);
+  float tau = (float) (time - times[k]);
+
+  const float* p0 = &points[k * count];
+  const float* p1 = &points[(k + 1) * count];
+  const float* m0 = &tangents[k * count];
+  const float* m1 = &tangents[(k + 1) * count];
+  const float* low = minimum.data();
+  const float* high = maximum.data();
+
+  // The profile shape only depends on time, so the weights are computed once
+  // and the loops over joints below are plain multiply-adds.
+  float w0, w1, w2, w3, d0, d1, d2, d3;
+
+  if (type == PROFILE_CUBIC) {
+
+    float u = tau / h, u2 = u * u, u3 = u2 * u;
+
+    w0 = 2 * u3 - 3 * u2 + 1;
+    w1 = (u3 - 2 * u2 + u) * h;
+    w2 = -2 * u3 + 3 * u2;
+    w3 = (u3 - u2) * h;
+
+    d0 = (6 * u2 - 6 * u) / h;
+    d1 = 3 * u2 - 4 * u + 1;
+    d2 = (-6 * u2 + 6 * u) / h;
+    d3 = 3 * u2 - 2 * u;
+
+  } else {
+
+    float ta = blend * h, s, ds;
+
+    if (ta <= 0) {
+      s = tau / h;
+      ds = 1 / h;
+    } else if (tau < ta) {
+      s = 0.5f * tau * tau / (ta * (h - ta));
+      ds = tau / (ta * (h - ta));
+    } else if (tau < h - ta) {
+      s = (tau - 0.5f * ta) / (h - ta);
+      ds = 1 / (h - ta);
+    } else {
+      s = 1 - 0.5f * (h - tau) * (h - tau) / (ta * (h - ta));
+      ds = (h - tau) / (ta * (h - ta));
+    }
+
+    w0 = 1 - s; w1 = 0; w2 = s; w3 = 0;
+    d0 = -ds; d1 = 0; d2 = ds; d3 = 0;
+
+  }
+
+  for (int j = 0; j < count; j++) {
+    float p = w0 * p0[j] + w1 * m0[j] + w2 * p1[j] + w3 * m1[j];
+    positions[j] = (int) lrintf(std::max(low[j], std::min(high[j], p)));
+  }
+
+  if (!velocities) return;
+
+  for (int j = 0; j < count; j++) {
+    float v = d0 * p0[j] + d1 * m0[j] + d2 * p1[j] + d3 * m1[j];
+    velocities[j] = (int) lrintf(v);
+  }
+
+}
+
+vector<CurveSegment> Trajectory::segments(int joint) const {
+
+  vector<CurveSegment> result;
+
+  for (int k = 0; k + 1 < (int) times.size(); k++) {
+
+    float h = (float) (times[k + 1] - times[k]);
+    float p0 = points[k * count + joint];
+    float p1 = points[(k + 1) * count + joint];
+
+    if (type == PROFILE_CUBIC || blend <= 0) {
+
+      CurveSegment segment;
+      segment.delta = std::max(1, (int) lrintf(h * 1000));
+      segment.position = (int) lrintf(p1);
+      segment.in_velocity = type == PROFILE_CUBIC ? (int) lrintf(tangents[k * count + joint]) : (int) lrintf((p1 - p0) / h);
+      segment.out_velocity = type == PROFILE_CUBIC ? (int) lrintf(tangents[(k + 1) * count + joint]) : segment.in_velocity;
+      result.push_back(segment);
+      continue;
+
+    }
+
+    // Acceleration and deceleration are quadratic, which a cubic Hermite
+    // segment represents exactly, cruise is linear.
+    float ta = blend * h;
+    float velocity = (p1 - p0) / (h - ta);
+    float accelerated = p0 + 0.5f * velocity * ta;
+
+    CurveSegment segment;
+
+    segment.delta = std::max(1, (int) lrintf(ta * 1000));
+    segment.position = (int) lrintf(accelerated);
+    segment.in_velocity = 0;
+    segment.out_velocity = (int) lrintf(velocity);
+    result.push_back(segment);
+
+    if (h - 2 * ta > 0) {
+      segment.delta = std::max(1, (int) lrintf((h - 2 * ta) * 1000));
+      segment.position = (int) lrintf(p1 - 0.5f * velocity * ta);
+      segment.in_velocity = segment.out_velocity;
+      result.push_back(segment);
+    }
+
+    segment.delta = std::max(1, (int) lrintf(ta * 1000));
+    segment.position = (int) lrintf(p1);
+    segment.in_velocity = (int) lrintf(velocity);
+    segment.out_velocity = 0;
+    result.push_back(segment);
+
+  }
+
+  return result;
+
+}
+
+}